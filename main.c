@@ -4,42 +4,132 @@
 #include "SDL_surface.h"
 #include <SDL.h>
 #include <SDL_image.h>
+#ifndef RAYCASTER_LIBRARY
 #include <SDL_ttf.h>
+#endif
+#include <float.h>
 #include <math.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "raycaster.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
 
 #define DEBUG 0
 
+#define RENDER_THREADS 0 // 0 = one per CPU core, 1 = main thread only
+
+#define PIPELINED_RENDER 1 // rasterize a frame while the last one is presented
+#define MAX_VIEWS 8
+#define SPLIT_VIEWS 1 // views side by side: 1, 2 or 4 (a 2x2 grid)
+#define PIP_VIEW 0 // inset rear view in the top right corner
+#define PIP_SCALE 25 // inset view size in percent of the frame
+#define SIM_HZ 120 // fixed simulation steps per second
+#define SIM_MAX_LAG 0.25f // seconds of simulation caught up at most
+
 #define FULLSCREEN_MODE 0
-#define SCREEN_WIDTH 1200
+#define SCREEN_WIDTH 1200 // initial window size
 #define SCREEN_HEIGHT 900
-#define STRIDE SCREEN_WIDTH * 4
+#define RENDER_SCALE 100 // internal resolution in percent of the window
+#define RENDER_SCALE_MIN 25
+#define RENDER_SCALE_STEP 5
+#define WALL_SCALE_MIN 25 // wall rays in percent of the render width
+
+// Dynamic resolution (--budget)
+#define FRAME_BUDGET_MS 16.6f
+#define DYNRES_HEADROOM 0.8f // raise resolution below this share of the budget
+#define DYNRES_SMOOTHING 0.1f
+#define DYNRES_SETTLE_FRAMES 30 // frames to wait after each adjustment
+#define IDLE_WAIT_MS 100 // longest wait for input while the view is unchanged
 
 #define FONT_PATH "fonts/EightBit Atari-Bt.ttf"
 #define FONT_SIZE 18
+#define HUD_FIRST_GLYPH ' '
+#define HUD_LAST_GLYPH '~'
+#define HUD_ATLAS_WIDTH 512
+
+#define PROFILER_HISTORY 256 // frames kept for the overlay graph
+#define PROFILER_AVERAGE 60  // frames averaged for the overlay timings
 
 #define CAMERA_RADIUS 0.1f
+#define COLLISION_SKIN 1e-3f // gap kept between moved circles and walls
+#define MAX_SLIDES 3 // wall contacts a move slides along before it stops
+#define AGENT_BATCH 256 // fewest agents worth moving on another thread
 #define FOV_FACTOR 0.66f
 
 #define WALL_DIM_FACTOR 0xC0u
 #define SKY_COLOR 0xFF202020u
 #define GROUND_COLOR 0xFF505050u
-#define FOG_FACTOR 0.03f
+#define DISTANCE_FOG 1
+#define FOG_FACTOR 0.03f // share of the light lost per unit of distance
+#define FOG_COLOR SKY_COLOR
+#define FOG_LEVELS 256 // distances are quantized into this many light levels
 
-#define MAP_FILE "map.txt"
+#define BENCH_FRAMES 600
+#define BENCH_TOLERANCE 0.15f // slowdown over the --baseline that fails
+#define BENCH_NOISE_MS 0.05f  // and the least that counts as one
+#define CHECK_POSES 24 // places --check renders from, each turning in place
+#define CHECK_TURNS 4  // for this many frames
+#define CHECK_THREADS 4
+#define CHECK_CACHE_TOLERANCE 0.001f // share of pixels reprojection may change
+#define CHECK_CAPTURES "check-failures" // frames of variants that failed
+#define SYNTHETIC_SEED 1 // of the maps generated for --synthetic
+#define RENDER_BATCH_FRAMES 64 // frames rendered at once for --out -
+
+#define MAP_PATH "map.txt"
 #define MAP_MAX_STEPS 1024
+#define CHUNK_SHIFT 6 // chunks are 64x64 cells, one solid mask word per row
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define MAP_CHUNK_BUDGET_MB 256 // bigger maps are streamed from their pack
+#define CHUNK_PREFETCH_RADIUS 3 // chunks kept loaded around the camera
+#define CHUNK_LOOKAHEAD 6 // chunks prefetched ahead along the view
+#define EMPTY_SPACE_SKIPPING 1
+#define PACKET_RAYS 1 // trace wall columns in SIMD packets of rays
+
+#define SPRITE_BUCKET_SIZE 16 // map cells per side of a sprite grid bucket
+#define SPRITE_MAX_DISTANCE 64.0f // sprites are drawn up to here, or the walls
+#define SPRITE_NEAR 0.1f // sprites closer to the camera are not drawn
+#define SPRITE_ALPHA_MIN 0x80u // texels with less alpha are see-through
+#define DOOR_SPEED 1.5f // share of the door opened per second
+#define DOOR_PASSABLE 0.9f // doors block movement until this far open
+#define DOOR_REACH 1.0f // how far ahead of the camera doors can be used
 
 #define TILE_MANIFEST "tiles.txt"
+#define PLACEHOLDER_COLOR 0xFF808080u // texels of tiles still loading
+#define PACK_MAGIC "RCPACK\0\1"
+#define PACK_VERSION 5
+#define PACK_ALIGN 64
+#define TEXTURE_ALIGN 64 // bytes, every mip starts on a cache line
+#define HUGE_PAGE_SIZE (2u << 20)
+#define MAX_TEXTURE_SIZE 8192 // larger images are decoded without a size hint
 #define TILE_BASE_SIZE 128
 #define MAX_TILE_ID 0xFF
-#define CEILING_TILE_ID 0x41
+#define MAP_NO_TILE MAX_TILE_ID // never registered, used for unknown ids
+#define CEILING_TILE_ID 0x41 // ceiling of maps without a ceiling layer
+#define MIPMAPPING 1
+#define MAX_MIP_LEVELS 16
 
+#ifndef RAYCASTER_LIBRARY
 static const float MOVE_SPEED_SEC = 5.0f;
 static const float ROT_SPEED_SEC = 5.0f;
+static const float SIM_STEP = 1.0f / SIM_HZ;
+#endif
 
 static inline int sgnf(float x) { return (x > 0) - (x < 0); }
 static inline int maxi(int a, int b) { return a > b ? a : b; }
@@ -48,6 +138,13 @@ static inline float clampf(float v, float lo, float hi) {
   return (v < lo) ? lo : (v > hi ? hi : v);
 }
 static inline float inv_abs(float v) { return 1.0f / (fabsf(v) + 1e-20f); }
+static inline int is_pow2(int v) { return v > 0 && (v & (v - 1)) == 0; }
+static inline int next_pow2(int v) {
+  int p = 1;
+  while (p < v)
+    p <<= 1;
+  return p;
+}
 
 typedef enum {
   TILE_TYPE_EMPTY,
@@ -57,470 +154,5581 @@ typedef enum {
   TILE_TYPE_DECOR,
 } TileType;
 
+typedef struct {
+  int width;
+  int height;
+  uint32_t *pixels;  // row-major
+  uint32_t *columns; // column-major copy for walls and sprites, NULL for floors
+  uint32_t *ceiling; // pre-darkened copy for floors, NULL otherwise
+  int kernel;        // FLOOR_KERNEL_* specialized for its size
+} TileMip;
+
+// The floor kernels are specialized for square mips of these sizes, any
+// other size gets the generic FLOOR_KERNEL_ANY.
+enum {
+  FLOOR_KERNEL_ANY,
+  FLOOR_KERNEL_64,
+  FLOOR_KERNEL_128,
+  FLOOR_KERNEL_256,
+  FLOOR_KERNEL_COUNT,
+};
+
 typedef struct {
   unsigned id;
   int width;
   int height;
-  uint32_t *pixels;
+  uint32_t *pixels;  // row-major
+  uint32_t *columns; // column-major copy for walls and sprites, NULL for floors
   TileType type;
+  int mip_count;
+  TileMip mips[MAX_MIP_LEVELS]; // mips[0] is the full resolution image
+  void *storage; // texels of a tile that didn't fit the arena, NULL otherwise
 } Tile;
-static Tile **tile_registry = NULL;
+static Tile *tile_registry = NULL; // id_lut points into this array
 static size_t tile_count = 0;
 static Tile *id_lut[MAX_TILE_ID + 1] = {NULL}; // Ensures O(1) access
+static uint8_t id_type[MAX_TILE_ID + 1]; // TileType per id, EMPTY if unused
+static uint32_t placeholder_texel = PLACEHOLDER_COLOR;
+static uint32_t placeholder_ceiling_texel =
+    0xFF000000u | ((PLACEHOLDER_COLOR >> 1) & 0x7F7F7Fu);
 
-void load_tiles(const char *manifest_path) {
-  FILE *f = fopen(manifest_path, "r");
-  if (!f) {
-    fprintf(stderr, "Failed to open tile manifest: %s\n", manifest_path);
-    return;
+// Texels of all manifest tiles, laid out from the image headers before any
+// of them is decoded. Every mip starts on a TEXTURE_ALIGN boundary.
+static struct {
+  uint32_t *texels;
+  size_t count;
+} tile_arena;
+
+// The mapped pack file while tiles (and maps) point into it
+static struct {
+  void *data;
+  size_t size;
+} pack;
+
+static void transpose_pixels(uint32_t *columns, const uint32_t *pixels,
+                             int width, int height) {
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      columns[(size_t)x * height + y] = pixels[(size_t)y * width + x];
+}
+
+static inline uint32_t darken_ceiling(uint32_t color) {
+  return 0xFF000000u | ((color >> 1) & 0x7F7F7Fu);
+}
+
+static void darken_pixels(uint32_t *ceiling, const uint32_t *pixels,
+                          int width, int height) {
+  for (size_t i = 0; i < (size_t)width * height; i++)
+    ceiling[i] = darken_ceiling(pixels[i]);
+}
+
+static inline size_t aligned_texels(int width, int height) {
+  const size_t align = TEXTURE_ALIGN / sizeof(uint32_t);
+  return ((size_t)width * height + align - 1) / align * align;
+}
+
+// Texels the whole mip chain of a tile takes, with the column copy of walls
+// and sprites or the ceiling copy of floors
+static size_t tile_texels(int width, int height) {
+  size_t total = 0;
+  for (int level = 0; level < MAX_MIP_LEVELS; level++) {
+    total += aligned_texels(width, height) * 2;
+    if (width == 1 && height == 1)
+      break;
+    width = maxi(1, width / 2);
+    height = maxi(1, height / 2);
   }
+  return total;
+}
 
-  unsigned id;
-  char filename[256], typestr[16];
-  while (1) {
-    int r = fscanf(f, "%x %255s %15s", &id, filename, typestr);
-    if (r != 3)
+// TEXTURE_ALIGN aligned texel memory; blocks of a huge page or more are
+// rounded up to whole huge pages and advised to be backed by them.
+static uint32_t *alloc_texels(size_t count) {
+  size_t bytes = count * sizeof(uint32_t);
+  size_t align = TEXTURE_ALIGN;
+  if (bytes >= HUGE_PAGE_SIZE) {
+    align = HUGE_PAGE_SIZE;
+    bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  }
+
+  void *texels;
+  if (posix_memalign(&texels, align, bytes) != 0)
+    return NULL;
+#ifdef MADV_HUGEPAGE
+  if (align == HUGE_PAGE_SIZE)
+    madvise(texels, bytes, MADV_HUGEPAGE);
+#endif
+  return texels;
+}
+
+static inline uint32_t average4(uint32_t a, uint32_t b, uint32_t c,
+                                uint32_t d) {
+  uint32_t rb = (a & 0xFF00FFu) + (b & 0xFF00FFu) + (c & 0xFF00FFu) +
+                (d & 0xFF00FFu) + 0x020002u;
+  uint32_t ag = ((a >> 8) & 0xFF00FFu) + ((b >> 8) & 0xFF00FFu) +
+                ((c >> 8) & 0xFF00FFu) + ((d >> 8) & 0xFF00FFu) + 0x020002u;
+  return ((rb >> 2) & 0xFF00FFu) | (((ag >> 2) & 0xFF00FFu) << 8);
+}
+
+static int mip_kernel(int width, int height) {
+  if (width != height)
+    return FLOOR_KERNEL_ANY;
+  switch (width) {
+  case 64:
+    return FLOOR_KERNEL_64;
+  case 128:
+    return FLOOR_KERNEL_128;
+  case 256:
+    return FLOOR_KERNEL_256;
+  default:
+    return FLOOR_KERNEL_ANY;
+  }
+}
+
+// Builds the mip chain down to 1x1 into texels, each level a 2x2 box filter
+// of the previous one. Wall and sprite levels get a column-major copy as
+// well, floor levels a darkened one for ceilings.
+static void build_mips(Tile *t, uint32_t *texels) {
+  t->mip_count = 1;
+
+  while (t->mip_count < MAX_MIP_LEVELS) {
+    const TileMip *src = &t->mips[t->mip_count - 1];
+    if (src->width == 1 && src->height == 1)
       break;
-    tile_count++;
+
+    TileMip *dst = &t->mips[t->mip_count];
+    dst->width = maxi(1, src->width / 2);
+    dst->height = maxi(1, src->height / 2);
+    dst->kernel = mip_kernel(dst->width, dst->height);
+    dst->columns = NULL;
+    dst->ceiling = NULL;
+    dst->pixels = texels;
+    texels += aligned_texels(dst->width, dst->height);
+    t->mip_count++;
+
+    for (int y = 0; y < dst->height; y++) {
+      const uint32_t *r0 = src->pixels + (size_t)mini(y * 2, src->height - 1) *
+                                             src->width;
+      const uint32_t *r1 =
+          src->pixels + (size_t)mini(y * 2 + 1, src->height - 1) * src->width;
+      for (int x = 0; x < dst->width; x++) {
+        int x0 = mini(x * 2, src->width - 1);
+        int x1 = mini(x * 2 + 1, src->width - 1);
+        dst->pixels[(size_t)y * dst->width + x] =
+            average4(r0[x0], r0[x1], r1[x0], r1[x1]);
+      }
+    }
+
+    if (t->columns) {
+      dst->columns = texels;
+      texels += aligned_texels(dst->width, dst->height);
+      transpose_pixels(dst->columns, dst->pixels, dst->width, dst->height);
+    }
+    if (src->ceiling) {
+      dst->ceiling = texels;
+      texels += aligned_texels(dst->width, dst->height);
+      darken_pixels(dst->ceiling, dst->pixels, dst->width, dst->height);
+    }
+  }
+}
+
+// Builds a tile from ARGB8888 rows, pitch bytes apart, into texels, which
+// has room for tile_texels() of them.
+static void create_tile(Tile *t, unsigned id, TileType type, int width,
+                        int height, const void *pixels, int pitch,
+                        uint32_t *texels) {
+  *t = (Tile){.id = id, .type = type, .width = width, .height = height};
+  t->pixels = texels;
+  texels += aligned_texels(width, height);
+  for (int y = 0; y < height; y++)
+    memcpy(t->pixels + (size_t)y * width, (const uint8_t *)pixels + y * pitch,
+           width * sizeof(uint32_t));
+
+  // walls and sprites are sampled one texture column at a time, keep those
+  // contiguous
+  if (t->type != TILE_TYPE_FLOOR) {
+    t->columns = texels;
+    texels += aligned_texels(width, height);
+    transpose_pixels(t->columns, t->pixels, width, height);
   }
 
-  tile_registry = calloc(tile_count, sizeof(Tile *));
-  if (!tile_registry) {
-    fprintf(stderr, "Memory allocation failed for tile registry\n");
-    fclose(f);
-    exit(EXIT_FAILURE);
+  t->mips[0] = (TileMip){width, height, t->pixels, t->columns, NULL,
+                         mip_kernel(width, height)};
+  // ceilings are drawn darker, bake that in once
+  if (t->type == TILE_TYPE_FLOOR) {
+    t->mips[0].ceiling = texels;
+    texels += aligned_texels(width, height);
+    darken_pixels(t->mips[0].ceiling, t->pixels, width, height);
   }
 
-  rewind(f);
+  build_mips(t, texels);
+}
 
-  size_t idx = 0;
-  while (fscanf(f, "%x %255s %15s", &id, filename, typestr) == 3) {
-    SDL_Surface *s = IMG_Load(filename);
-    if (!s) {
-      fprintf(stderr, "IMG_Load(%s): %s\n", filename, IMG_GetError());
-      SDL_FreeSurface(s);
-      exit(EXIT_FAILURE);
+typedef struct {
+  unsigned id;
+  TileType type;
+  char path[256];
+  // from the image header, rounded up to powers of two, 0 if it couldn't be
+  // read
+  int width;
+  int height;
+  size_t texels; // offset into tile_arena
+} TileEntry;
+
+// Textures are decoded by background threads once the manifest is read.
+// Until then every tile is a 1x1 PLACEHOLDER_COLOR stand-in with the right
+// type. Decoded tiles are copied into tile_registry by tile_loader_publish()
+// between frames, so renders never see one change.
+static struct {
+  TileEntry *entries;
+  int *order;       // entry indices in decode order
+  Tile *ready;      // decoded tile per entry until published
+  uint8_t *pending; // set while ready[i] waits to be published
+  int next;         // position in order of the next entry to decode
+  int remaining;    // entries not decoded yet
+  int failed;
+  int quit;
+  unsigned revision; // bumped whenever tiles are published
+  int thread_count;
+  SDL_Thread **threads;
+  SDL_mutex *lock;
+  SDL_cond *decoded;
+} tile_loader;
+
+// Bilinear resample of width x height pixels, rows pitch bytes apart, to
+// dst_width x dst_height, wrapping around the edges like the tile does.
+static void resample_pixels(uint32_t *dst, int dst_width, int dst_height,
+                            const void *pixels, int width, int height,
+                            int pitch) {
+  for (int y = 0; y < dst_height; y++) {
+    float sy = ((float)y + 0.5f) * height / dst_height - 0.5f;
+    int y0 = (int)floorf(sy);
+    float fy = sy - (float)y0;
+    const uint32_t *r0 = (const uint32_t *)((const uint8_t *)pixels +
+                                            ((y0 + height) % height) * pitch);
+    const uint32_t *r1 = (const uint32_t *)((const uint8_t *)pixels +
+                                            ((y0 + 1) % height) * pitch);
+    for (int x = 0; x < dst_width; x++) {
+      float sx = ((float)x + 0.5f) * width / dst_width - 0.5f;
+      int x0 = (int)floorf(sx);
+      float fx = sx - (float)x0;
+      int x1 = (x0 + 1) % width;
+      x0 = (x0 + width) % width;
+
+      uint32_t color = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        float top = (1.0f - fx) * ((r0[x0] >> shift) & 0xFF) +
+                    fx * ((r0[x1] >> shift) & 0xFF);
+        float bottom = (1.0f - fx) * ((r1[x0] >> shift) & 0xFF) +
+                       fx * ((r1[x1] >> shift) & 0xFF);
+        color |= (uint32_t)((1.0f - fy) * top + fy * bottom + 0.5f) << shift;
+      }
+      dst[(size_t)y * dst_width + x] = color;
     }
+  }
+}
 
-    if (s->format->format != SDL_PIXELFORMAT_ARGB8888) {
-      SDL_Surface *conv =
-          SDL_ConvertSurfaceFormat(s, SDL_PIXELFORMAT_ARGB8888, 0);
-      SDL_FreeSurface(s);
-      s = conv;
+static int decode_tile(const TileEntry *e, Tile *t) {
+  SDL_Surface *s = IMG_Load(e->path);
+  if (!s) {
+    fprintf(stderr, "IMG_Load(%s): %s\n", e->path, IMG_GetError());
+    return 0;
+  }
+
+  if (s->format->format != SDL_PIXELFORMAT_ARGB8888) {
+    SDL_Surface *conv = SDL_ConvertSurfaceFormat(s, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(s);
+    s = conv;
+    if (!s) {
+      fprintf(stderr, "SDL_ConvertSurfaceFormat(%s): %s\n", e->path,
+              SDL_GetError());
+      return 0;
     }
+  }
 
-    Tile *t = malloc(sizeof(Tile));
-    if (!t) {
-      fprintf(stderr, "Memory allocation failed for tile %u\n", id);
+  // every sampler wraps texel coordinates with a mask, so tiles are scaled
+  // up to power of two sizes
+  int width = next_pow2(s->w), height = next_pow2(s->h);
+  const void *pixels = s->pixels;
+  int pitch = s->pitch;
+  uint32_t *resampled = NULL;
+  if (width != s->w || height != s->h) {
+    resampled = malloc((size_t)width * height * sizeof(uint32_t));
+    if (!resampled) {
+      fprintf(stderr, "Memory allocation failed for tile %u\n", e->id);
       SDL_FreeSurface(s);
-      exit(EXIT_FAILURE);
+      return 0;
     }
+    resample_pixels(resampled, width, height, s->pixels, s->w, s->h,
+                    s->pitch);
+    pixels = resampled;
+    pitch = width * (int)sizeof(uint32_t);
+  }
 
-    t->id = id;
-    t->width = s->w;
-    t->height = s->h;
-    t->pixels = malloc(t->width * t->height * sizeof(uint32_t));
-    if (!t->pixels) {
-      fprintf(stderr, "Memory allocation failed for tile pixels %u\n", id);
-      free(t);
-      SDL_FreeSurface(s);
-      exit(EXIT_FAILURE);
+  // tiles whose size wasn't known up front get texels of their own
+  uint32_t *texels = NULL, *storage = NULL;
+  if (width == e->width && height == e->height)
+    texels = tile_arena.texels + e->texels;
+  else
+    texels = storage = alloc_texels(tile_texels(width, height));
+
+  if (texels) {
+    create_tile(t, e->id, e->type, width, height, pixels, pitch, texels);
+    t->storage = storage;
+  } else {
+    fprintf(stderr, "Memory allocation failed for tile %u\n", e->id);
+  }
+  free(resampled);
+  SDL_FreeSurface(s);
+  return texels != NULL;
+}
+
+static int tile_decoder(void *data) {
+  (void)data;
+  SDL_LockMutex(tile_loader.lock);
+  while (!tile_loader.quit && tile_loader.next < (int)tile_count) {
+    int i = tile_loader.order[tile_loader.next++];
+    SDL_UnlockMutex(tile_loader.lock);
+
+    Tile t;
+    int ok = decode_tile(&tile_loader.entries[i], &t);
+
+    SDL_LockMutex(tile_loader.lock);
+    if (ok) {
+      tile_loader.ready[i] = t;
+      tile_loader.pending[i] = 1;
     }
-    t->type = (strcmp(typestr, "floor") == 0)  ? TILE_TYPE_FLOOR
-              : (strcmp(typestr, "wall") == 0) ? TILE_TYPE_WALL
-              : (strcmp(typestr, "door") == 0) ? TILE_TYPE_DOOR
-                                               : TILE_TYPE_DECOR;
+    tile_loader.failed |= !ok;
+    tile_loader.remaining--;
+    SDL_CondBroadcast(tile_loader.decoded);
+  }
+  SDL_UnlockMutex(tile_loader.lock);
+  return 0;
+}
 
-    memcpy(t->pixels, s->pixels, t->width * t->height * sizeof(uint32_t));
-    SDL_FreeSurface(s);
+// Copies the tiles decoded since the last call in. Returns 0 once a
+// texture has failed to load.
+static int tile_loader_publish(void) {
+  if (!tile_loader.lock)
+    return 1;
+
+  SDL_LockMutex(tile_loader.lock);
+  for (size_t i = 0; i < tile_count; i++) {
+    if (!tile_loader.pending[i])
+      continue;
+    tile_registry[i] = tile_loader.ready[i];
+    tile_loader.pending[i] = 0;
+    tile_loader.revision++;
+  }
+  int ok = !tile_loader.failed;
+  SDL_UnlockMutex(tile_loader.lock);
+  return ok;
+}
+
+// Blocks until every texture is decoded and published.
+static int tile_loader_wait(void) {
+  if (!tile_loader.lock)
+    return 1;
 
-    tile_registry[idx++] = t;
+  SDL_LockMutex(tile_loader.lock);
+  while (tile_loader.remaining > 0)
+    SDL_CondWait(tile_loader.decoded, tile_loader.lock);
+  SDL_UnlockMutex(tile_loader.lock);
+  return tile_loader_publish();
+}
 
-    if (id < MAX_TILE_ID)
-      id_lut[id] = t;
+static void tile_loader_stop(void) {
+  if (tile_loader.lock) {
+    SDL_LockMutex(tile_loader.lock);
+    tile_loader.quit = 1;
+    SDL_UnlockMutex(tile_loader.lock);
   }
+  for (int i = 0; i < tile_loader.thread_count; i++)
+    SDL_WaitThread(tile_loader.threads[i], NULL);
+  for (size_t i = 0; tile_loader.pending && i < tile_count; i++)
+    if (tile_loader.pending[i])
+      free(tile_loader.ready[i].storage);
+  if (tile_loader.lock)
+    SDL_DestroyMutex(tile_loader.lock);
+  if (tile_loader.decoded)
+    SDL_DestroyCond(tile_loader.decoded);
+  free(tile_loader.entries);
+  free(tile_loader.order);
+  free(tile_loader.ready);
+  free(tile_loader.pending);
+  free(tile_loader.threads);
+  memset(&tile_loader, 0, sizeof(tile_loader));
+}
 
-#if DEBUG
-  if (idx != tile_count) {
-    fprintf(stderr, "Warning: Expected %zu tiles, but loaded %zu\n", tile_count,
-            idx);
+static inline uint32_t read_be32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+         p[3];
+}
+
+// Reads the size of a PNG from its IHDR chunk. 0 for anything else.
+static int png_size(const char *path, int *width, int *height) {
+  uint8_t header[24];
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return 0;
+  size_t n = fread(header, 1, sizeof(header), f);
+  fclose(f);
+  if (n != sizeof(header) || memcmp(header, "\x89PNG\r\n\x1a\n", 8) != 0 ||
+      memcmp(header + 12, "IHDR", 4) != 0)
+    return 0;
+
+  uint32_t w = read_be32(header + 16);
+  uint32_t h = read_be32(header + 20);
+  if (w == 0 || h == 0 || w > MAX_TEXTURE_SIZE || h > MAX_TEXTURE_SIZE)
+    return 0;
+  *width = (int)w;
+  *height = (int)h;
+  return 1;
+}
+
+// Reads the manifest, lays the texel arena out from the image headers and
+// registers a placeholder for every tile; the textures are decoded once
+// tile_loader_start() knows which ones the map needs first.
+void load_tiles(const char *manifest_path) {
+  FILE *f = fopen(manifest_path, "r");
+  if (!f) {
+    fprintf(stderr, "Failed to open tile manifest: %s\n", manifest_path);
+    return;
   }
-#endif
 
+  size_t capacity = 0;
+  TileEntry e;
+  char typestr[16];
+  while (fscanf(f, "%x %255s %15s", &e.id, e.path, typestr) == 3) {
+    e.type = (strcmp(typestr, "floor") == 0)  ? TILE_TYPE_FLOOR
+             : (strcmp(typestr, "wall") == 0) ? TILE_TYPE_WALL
+             : (strcmp(typestr, "door") == 0) ? TILE_TYPE_DOOR
+                                              : TILE_TYPE_DECOR;
+    if (tile_count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      TileEntry *entries =
+          realloc(tile_loader.entries, capacity * sizeof(TileEntry));
+      if (!entries) {
+        fprintf(stderr, "Memory allocation failed for tile registry\n");
+        fclose(f);
+        exit(EXIT_FAILURE);
+      }
+      tile_loader.entries = entries;
+    }
+
+    e.texels = tile_arena.count;
+    if (png_size(e.path, &e.width, &e.height)) {
+      e.width = next_pow2(e.width);
+      e.height = next_pow2(e.height);
+      tile_arena.count += tile_texels(e.width, e.height);
+    } else {
+      e.width = e.height = 0;
+    }
+    tile_loader.entries[tile_count++] = e;
+  }
   fclose(f);
+  if (tile_count == 0)
+    return;
+
+  tile_registry = calloc(tile_count, sizeof(Tile));
+  if (tile_arena.count)
+    tile_arena.texels = alloc_texels(tile_arena.count);
+  if (!tile_registry || (tile_arena.count && !tile_arena.texels)) {
+    fprintf(stderr, "Memory allocation failed for tile registry\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t i = 0; i < tile_count; i++) {
+    const TileEntry *entry = &tile_loader.entries[i];
+    Tile *t = &tile_registry[i];
+    t->id = entry->id;
+    t->type = entry->type;
+    t->width = t->height = 1;
+    t->pixels = &placeholder_texel;
+    t->columns = t->type != TILE_TYPE_FLOOR ? &placeholder_texel : NULL;
+    t->mips[0] =
+        (TileMip){1, 1, t->pixels, t->columns, NULL, FLOOR_KERNEL_ANY};
+    if (t->type == TILE_TYPE_FLOOR)
+      t->mips[0].ceiling = &placeholder_ceiling_texel;
+    t->mip_count = 1;
+
+    if (t->id < MAX_TILE_ID) {
+      id_lut[t->id] = t;
+      id_type[t->id] = t->type;
+    }
+  }
 }
 
 static inline Tile *get_tile_by_id(unsigned id) {
   return (id <= MAX_TILE_ID) ? id_lut[id] : NULL;
 }
 
+// Picks the mip whose texels are about one screen pixel apart, given how
+// many full resolution texels a screen pixel covers.
+static inline int mip_level(const Tile *t, float texels_per_pixel) {
+#if MIPMAPPING
+  if (!(texels_per_pixel >= 2.0f))
+    return 0;
+  return maxi(0, mini(ilogbf(texels_per_pixel), t->mip_count - 1));
+#else
+  (void)t;
+  (void)texels_per_pixel;
+  return 0;
+#endif
+}
+
 void free_tile_registry() {
-  for (size_t i = 0; i < tile_count; i++) {
-    free(tile_registry[i]->pixels);
-    free(tile_registry[i]);
-  }
+  tile_loader_stop();
+  for (size_t i = 0; tile_registry && i < tile_count; i++)
+    free(tile_registry[i].storage);
   free(tile_registry);
   tile_registry = NULL;
   tile_count = 0;
+  free(tile_arena.texels);
+  memset(&tile_arena, 0, sizeof(tile_arena));
+  memset(id_lut, 0, sizeof(id_lut));
+  memset(id_type, 0, sizeof(id_type));
+
+  if (pack.data) {
+    munmap(pack.data, pack.size);
+    pack.data = NULL;
+    pack.size = 0;
+  }
+}
+
+typedef RaycasterPose Camera;
+
+// The map is stored in CHUNK_SIZE x CHUNK_SIZE chunks so that big maps can
+// be streamed. A chunk holds the tile ids, the solid bitmask (walls, closed
+// doors and cells without a tile, one word per row) that collision and ray
+// marching test instead of touching tiles, and the Chebyshev distance from
+// each cell to the nearest wall or door, capped at 255, that rays use to
+// skip empty space.
+// The ceiling layer holds the tile above each cell, drawn over the floor.
+typedef struct {
+  uint8_t ids[CHUNK_SIZE * CHUNK_SIZE];
+  uint8_t ceiling[CHUNK_SIZE * CHUNK_SIZE];
+  uint8_t wall_distance[CHUNK_SIZE * CHUNK_SIZE];
+  uint64_t solid[CHUNK_SIZE];
+} MapChunk;
+
+// Stands in for chunks that aren't resident: solid for collision, but no
+// walls, so rays step through it one cell at a time.
+static MapChunk missing_chunk;
+
+typedef struct MapStream MapStream;
+
+// A billboard standing on the floor, one cell wide and tall, facing the
+// camera. The texture comes from the tile with this id.
+typedef struct {
+  float x, y; // centre, inside the map
+  uint32_t id;
+} Sprite;
+
+// World sprites, bucketed by a uniform grid of SPRITE_BUCKET_SIZE cells so a
+// frame only visits the buckets in view. order holds sprite indices sorted by
+// bucket, bucket b's being order[bucket_start[b]] to order[bucket_start[b+1]].
+typedef struct {
+  Sprite *sprites;
+  int count;
+  int capacity;
+  int buckets_x;
+  int buckets_y;
+  int *bucket_start;
+  int *order;
+} SpriteGrid;
+
+// A door panel slides along the middle of its cell into the wall next to
+// it. open is the share slid away, speed its change per second while the
+// door moves. Doors start closed and only get an entry once they are used.
+typedef struct {
+  int x, y;
+  float open;
+  float speed;
+} Door;
+
+// Doors by cell in an open addressing table, slots holding door index + 1,
+// plus the doors still moving so an update only visits those.
+typedef struct {
+  Door *doors;
+  int count;
+  int capacity;
+  int *slots;
+  int slot_count; // power of two, at least twice count
+  int *moving;
+  int moving_count;
+} DoorTable;
+
+struct Map {
+  size_t width;
+  size_t height;
+  int chunks_x;
+  int chunks_y;
+  MapChunk **chunks; // row-major, &missing_chunk until loaded
+  MapChunk *storage; // owned chunks when the whole map is in memory
+  MapStream *stream; // loads chunks in the background, NULL if all resident
+  SpriteGrid sprites; // always resident
+  DoorTable doors;    // always resident
+  unsigned revision;  // bumped by every change that frames can show
+};
+
+static void map_stream_destroy(MapStream *stream);
+
+static void free_map(struct Map *map) {
+  map_stream_destroy(map->stream);
+  free(map->storage);
+  free(map->chunks);
+  free(map->sprites.sprites);
+  free(map->sprites.bucket_start);
+  free(map->sprites.order);
+  free(map->doors.doors);
+  free(map->doors.slots);
+  free(map->doors.moving);
+  *map = (struct Map){0};
+}
+
+static inline MapChunk *map_chunk(const struct Map *m, int x, int y) {
+  return m->chunks[(y >> CHUNK_SHIFT) * m->chunks_x + (x >> CHUNK_SHIFT)];
+}
+static inline int chunk_cell(int x, int y) {
+  return (y & (CHUNK_SIZE - 1)) * CHUNK_SIZE + (x & (CHUNK_SIZE - 1));
+}
+
+static void init_missing_chunk(void) {
+  memset(missing_chunk.ids, MAP_NO_TILE, sizeof(missing_chunk.ids));
+  memset(missing_chunk.ceiling, MAP_NO_TILE, sizeof(missing_chunk.ceiling));
+  memset(missing_chunk.wall_distance, 0, sizeof(missing_chunk.wall_distance));
+  memset(missing_chunk.solid, 0xFF, sizeof(missing_chunk.solid));
+}
+
+// Sets up the chunk directory with every chunk missing.
+static int map_init_chunks(struct Map *map, size_t width, size_t height) {
+  init_missing_chunk();
+  map->width = width;
+  map->height = height;
+  map->chunks_x = (int)((width + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  map->chunks_y = (int)((height + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  map->chunks = malloc((size_t)map->chunks_x * map->chunks_y *
+                       sizeof(*map->chunks));
+  if (!map->chunks)
+    return 0;
+  for (int i = 0; i < map->chunks_x * map->chunks_y; i++)
+    map->chunks[i] = &missing_chunk;
+  return 1;
+}
+
+// Walls and doors, open or not, stop rays and seed the wall distances.
+static inline int blocks_rays(TileType type) {
+  return type == TILE_TYPE_WALL || type == TILE_TYPE_DOOR;
+}
+
+// Doors are set closed.
+static void map_set_id(struct Map *map, int x, int y, unsigned id) {
+  MapChunk *c = map_chunk(map, x, y);
+  TileType type = id_type[id];
+  uint64_t bit = 1ull << (x & (CHUNK_SIZE - 1));
+  c->ids[chunk_cell(x, y)] = (uint8_t)id;
+  if (blocks_rays(type) || type == TILE_TYPE_EMPTY)
+    c->solid[y & (CHUNK_SIZE - 1)] |= bit;
+  else
+    c->solid[y & (CHUNK_SIZE - 1)] &= ~bit;
+}
+
+static void map_set_ceiling(struct Map *map, int x, int y, unsigned id) {
+  map_chunk(map, x, y)->ceiling[chunk_cell(x, y)] = (uint8_t)id;
+}
+
+// Adds a sprite at (x, y), which has to be inside the map. Call
+// sprite_grid_build() before the next frame.
+static int map_add_sprite(struct Map *map, float x, float y, unsigned id) {
+  SpriteGrid *g = &map->sprites;
+  if (g->count == g->capacity) {
+    int capacity = g->capacity ? g->capacity * 2 : 64;
+    Sprite *sprites = realloc(g->sprites, capacity * sizeof(Sprite));
+    if (!sprites)
+      return 0;
+    g->sprites = sprites;
+    g->capacity = capacity;
+  }
+  g->sprites[g->count++] = (Sprite){x, y, id};
+  return 1;
+}
+
+static inline int sprite_bucket(const SpriteGrid *g, const Sprite *sp) {
+  int bx = mini(maxi((int)sp->x / SPRITE_BUCKET_SIZE, 0), g->buckets_x - 1);
+  int by = mini(maxi((int)sp->y / SPRITE_BUCKET_SIZE, 0), g->buckets_y - 1);
+  return by * g->buckets_x + bx;
+}
+
+// Sorts the sprites into their buckets, O(sprites + buckets). Has to run
+// again once sprites were added or moved.
+static int sprite_grid_build(struct Map *map) {
+  SpriteGrid *g = &map->sprites;
+  g->buckets_x =
+      (int)((map->width + SPRITE_BUCKET_SIZE - 1) / SPRITE_BUCKET_SIZE);
+  g->buckets_y =
+      (int)((map->height + SPRITE_BUCKET_SIZE - 1) / SPRITE_BUCKET_SIZE);
+  size_t buckets = (size_t)g->buckets_x * g->buckets_y;
+
+  int *start = realloc(g->bucket_start, (buckets + 1) * sizeof(int));
+  if (start)
+    g->bucket_start = start;
+  int *order = realloc(g->order, maxi(g->count, 1) * sizeof(int));
+  if (order)
+    g->order = order;
+  if (!start || !order) {
+    fprintf(stderr, "Memory allocation failed for sprite grid\n");
+    return 0;
+  }
+
+  // counting sort: count, prefix sum, then scatter, which leaves each start
+  // at the next bucket's so they are shifted back up
+  memset(start, 0, (buckets + 1) * sizeof(int));
+  for (int i = 0; i < g->count; i++)
+    start[sprite_bucket(g, &g->sprites[i]) + 1]++;
+  for (size_t b = 0; b < buckets; b++)
+    start[b + 1] += start[b];
+  for (int i = 0; i < g->count; i++)
+    order[start[sprite_bucket(g, &g->sprites[i])]++] = i;
+  for (size_t b = buckets; b > 0; b--)
+    start[b] = start[b - 1];
+  start[0] = 0;
+  return 1;
+}
+
+static inline uint8_t min_distance(uint8_t d, uint8_t neighbour) {
+  return neighbour < d ? neighbour + 1 : d;
+}
+
+static inline uint8_t *distance_at(struct Map *map, int x, int y) {
+  return &map_chunk(map, x, y)->wall_distance[chunk_cell(x, y)];
+}
+
+// Two pass chessboard distance transform over the cells [x0, x1] x [y0, y1],
+// which also reads the distances of their neighbours outside. Cells outside
+// the map count as empty since rays never hit them.
+static void distance_passes(struct Map *map, int x0, int y0, int x1, int y1) {
+  int w = (int)map->width, h = (int)map->height;
+
+  for (int y = y0; y <= y1; y++) {
+    for (int x = x0; x <= x1; x++) {
+      uint8_t v = *distance_at(map, x, y);
+      if (x > 0)
+        v = min_distance(v, *distance_at(map, x - 1, y));
+      if (y > 0) {
+        v = min_distance(v, *distance_at(map, x, y - 1));
+        if (x > 0)
+          v = min_distance(v, *distance_at(map, x - 1, y - 1));
+        if (x + 1 < w)
+          v = min_distance(v, *distance_at(map, x + 1, y - 1));
+      }
+      *distance_at(map, x, y) = v;
+    }
+  }
+
+  for (int y = y1; y >= y0; y--) {
+    for (int x = x1; x >= x0; x--) {
+      uint8_t v = *distance_at(map, x, y);
+      if (x + 1 < w)
+        v = min_distance(v, *distance_at(map, x + 1, y));
+      if (y + 1 < h) {
+        v = min_distance(v, *distance_at(map, x, y + 1));
+        if (x > 0)
+          v = min_distance(v, *distance_at(map, x - 1, y + 1));
+        if (x + 1 < w)
+          v = min_distance(v, *distance_at(map, x + 1, y + 1));
+      }
+      *distance_at(map, x, y) = v;
+    }
+  }
+}
+
+static void build_wall_distance(struct Map *map) {
+  int w = (int)map->width, h = (int)map->height;
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      *distance_at(map, x, y) =
+          blocks_rays(id_type[map_chunk(map, x, y)->ids[chunk_cell(x, y)]])
+              ? 0
+              : 255;
+  distance_passes(map, 0, 0, w - 1, h - 1);
+}
+
+// Sets up a map that is wholly resident, with every cell solid and without
+// a tile.
+static int map_init_storage(struct Map *map, size_t width, size_t height) {
+  if (!map_init_chunks(map, width, height) ||
+      !(map->storage = malloc((size_t)map->chunks_x * map->chunks_y *
+                              sizeof(MapChunk))))
+    return 0;
+  for (int i = 0; i < map->chunks_x * map->chunks_y; i++) {
+    map->storage[i] = missing_chunk;
+    map->chunks[i] = &map->storage[i];
+  }
+  return 1;
+}
+
+static struct Map load_map(const char *filename) {
+  struct Map map = {0};
+
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open map file: %s\n", filename);
+    return map;
+  }
+
+  size_t width, height;
+  if (fscanf(file, "%zu %zu", &width, &height) != 2 || width <= 0 ||
+      height <= 0) {
+    fprintf(stderr, "Invalid map dimensions in file: %s\n", filename);
+    fclose(file);
+    return map;
+  }
+
+  if (!map_init_storage(&map, width, height)) {
+    free_map(&map);
+    fclose(file);
+    return map;
+  }
+
+  for (size_t y = 0; y < map.height; y++) {
+    for (size_t x = 0; x < map.width; x++) {
+      unsigned hex;
+      if (fscanf(file, "%x", &hex) != 1) {
+        fprintf(stderr, "Premature end of map data at (%zu, %zu)\n", x, y);
+        free_map(&map);
+        fclose(file);
+        return map;
+      }
+      unsigned id = hex > MAX_TILE_ID ? MAP_NO_TILE : hex;
+      map_set_id(&map, (int)x, (int)y, id);
+
+      // decor cells are drawn as sprites in their centre
+      if (id_type[id] == TILE_TYPE_DECOR &&
+          !map_add_sprite(&map, x + 0.5f, y + 0.5f, id)) {
+        fprintf(stderr, "Memory allocation failed for sprites\n");
+        free_map(&map);
+        fclose(file);
+        return map;
+      }
+    }
+  }
+
+  // an optional second grid of the same size holds the ceiling layer
+  unsigned hex;
+  int ceiling = fscanf(file, "%x", &hex) == 1;
+  for (size_t y = 0; y < map.height; y++) {
+    for (size_t x = 0; x < map.width; x++) {
+      if (ceiling && (x > 0 || y > 0) && fscanf(file, "%x", &hex) != 1) {
+        fprintf(stderr, "Premature end of ceiling data at (%zu, %zu)\n", x,
+                y);
+        free_map(&map);
+        fclose(file);
+        return map;
+      }
+      map_set_ceiling(&map, (int)x, (int)y,
+                      !ceiling             ? CEILING_TILE_ID
+                      : hex > MAX_TILE_ID ? MAP_NO_TILE
+                                          : hex);
+    }
+  }
+
+  fclose(file);
+  build_wall_distance(&map);
+  if (!sprite_grid_build(&map))
+    free_map(&map);
+
+#if DEBUG
+  if (map.chunks == NULL)
+    fprintf(stderr, "Failed to load map tiles from file: %s\n", filename);
+#endif
+
+  return map;
+}
+
+// First registered tile id of the type, MAP_NO_TILE if there is none.
+static unsigned first_tile_of(TileType type) {
+  for (unsigned id = 0; id < MAX_TILE_ID; id++)
+    if (id_type[id] == type)
+      return id;
+  return MAP_NO_TILE;
+}
+
+// A size x size map for tests and benchmarks of maps larger than map.txt,
+// the same for a given seed: a floor of the first floor tile scattered
+// with walls, doors and decor of the first tiles of those types, a few
+// cells open to the sky and walls all around. The start of
+// initial_camera() is kept clear.
+static struct Map generate_map(int size, unsigned seed) {
+  struct Map map = {0};
+  if (size < 8 || !map_init_storage(&map, size, size)) {
+    fprintf(stderr, "Failed to generate a %dx%d map\n", size, size);
+    free_map(&map);
+    return map;
+  }
+
+  unsigned floor = first_tile_of(TILE_TYPE_FLOOR);
+  unsigned wall = first_tile_of(TILE_TYPE_WALL);
+  unsigned door = first_tile_of(TILE_TYPE_DOOR);
+  unsigned decor = first_tile_of(TILE_TYPE_DECOR);
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      uint32_t h = ((uint32_t)(y * size + x) ^ seed) * 2654435761u;
+      h ^= h >> 15;
+      h *= 2246822519u;
+      h ^= h >> 13;
+
+      unsigned id = floor;
+      int roll = (int)(h % 100);
+      if (x == 0 || y == 0 || x == size - 1 || y == size - 1)
+        id = wall;
+      else if (x <= 3 && y <= 3)
+        id = floor;
+      else if (roll < 16)
+        id = wall;
+      else if (roll < 18 && door != MAP_NO_TILE)
+        id = door;
+      else if (roll < 19 && decor != MAP_NO_TILE)
+        id = decor;
+      map_set_id(&map, x, y, id);
+      unsigned ceiling = (h >> 8) % 10 ? CEILING_TILE_ID : MAP_NO_TILE;
+      map_set_ceiling(&map, x, y, ceiling);
+
+      if (id_type[id] == TILE_TYPE_DECOR &&
+          !map_add_sprite(&map, x + 0.5f, y + 0.5f, id)) {
+        fprintf(stderr, "Memory allocation failed for sprites\n");
+        free_map(&map);
+        return map;
+      }
+    }
+  }
+
+  build_wall_distance(&map);
+  if (!sprite_grid_build(&map))
+    free_map(&map);
+  return map;
+}
+
+// Out of bounds cells have no tile: TILE_TYPE_EMPTY and solid.
+static inline TileType map_type(const struct Map *m, int x, int y) {
+  if ((unsigned)x >= m->width || (unsigned)y >= m->height)
+    return TILE_TYPE_EMPTY;
+  return id_type[map_chunk(m, x, y)->ids[chunk_cell(x, y)]];
+}
+static inline Tile *get_tile(const struct Map *m, int x, int y) {
+  if ((unsigned)x >= m->width || (unsigned)y >= m->height)
+    return NULL;
+  return id_lut[map_chunk(m, x, y)->ids[chunk_cell(x, y)]];
+}
+static inline Tile *get_floor_tile(const struct Map *m, int x, int y) {
+  return map_type(m, x, y) == TILE_TYPE_FLOOR ? get_tile(m, x, y) : NULL;
+}
+// Ceilings use floor tiles, which carry pre-darkened copies for it.
+static inline Tile *get_ceiling_tile(const struct Map *m, int x, int y) {
+  if ((unsigned)x >= m->width || (unsigned)y >= m->height)
+    return NULL;
+  uint8_t id = map_chunk(m, x, y)->ceiling[chunk_cell(x, y)];
+  return id_type[id] == TILE_TYPE_FLOOR ? id_lut[id] : NULL;
+}
+// 0 outside the map, so rays there are stepped one cell at a time.
+static inline int map_wall_distance(const struct Map *m, int x, int y) {
+  if ((unsigned)x >= m->width || (unsigned)y >= m->height)
+    return 0;
+  return map_chunk(m, x, y)->wall_distance[chunk_cell(x, y)];
+}
+static inline int is_solid(const struct Map *map, int x, int y) {
+  if ((unsigned)x >= map->width || (unsigned)y >= map->height)
+    return 1;
+  return (map_chunk(map, x, y)->solid[y & (CHUNK_SIZE - 1)] >>
+          (x & (CHUNK_SIZE - 1))) &
+         1;
+}
+
+static inline unsigned door_slot(const DoorTable *t, const struct Map *m,
+                                 int x, int y) {
+  uint32_t h = (uint32_t)(y * (int)m->width + x) * 2654435761u;
+  return (h ^ (h >> 16)) & (unsigned)(t->slot_count - 1);
+}
+
+// The door at (x, y), NULL if it was never used and so is closed.
+static Door *map_door(const struct Map *map, int x, int y) {
+  const DoorTable *t = &map->doors;
+  if (!t->count)
+    return NULL;
+  unsigned mask = (unsigned)t->slot_count - 1;
+  for (unsigned i = door_slot(t, map, x, y);; i = (i + 1) & mask) {
+    int slot = t->slots[i];
+    if (!slot)
+      return NULL;
+    Door *d = &t->doors[slot - 1];
+    if (d->x == x && d->y == y)
+      return d;
+  }
+}
+
+#ifndef RAYCASTER_LIBRARY
+static Door *map_add_door(struct Map *map, int x, int y) {
+  DoorTable *t = &map->doors;
+  if (t->count == t->capacity) {
+    int capacity = t->capacity ? t->capacity * 2 : 64;
+    Door *doors = realloc(t->doors, capacity * sizeof(Door));
+    if (doors)
+      t->doors = doors;
+    int *moving = realloc(t->moving, capacity * sizeof(int));
+    if (moving)
+      t->moving = moving;
+    if (!doors || !moving)
+      return NULL;
+    t->capacity = capacity;
+  }
+  if ((t->count + 1) * 2 > t->slot_count) {
+    int slot_count = t->slot_count ? t->slot_count * 2 : 128;
+    int *slots = calloc(slot_count, sizeof(int));
+    if (!slots)
+      return NULL;
+    free(t->slots);
+    t->slots = slots;
+    t->slot_count = slot_count;
+    for (int i = 0; i < t->count; i++) {
+      unsigned j = door_slot(t, map, t->doors[i].x, t->doors[i].y);
+      while (slots[j])
+        j = (j + 1) & (slot_count - 1);
+      slots[j] = i + 1;
+    }
+  }
+
+  unsigned j = door_slot(t, map, x, y);
+  while (t->slots[j])
+    j = (j + 1) & (t->slot_count - 1);
+  t->slots[j] = t->count + 1;
+  t->doors[t->count] = (Door){x, y, 0.0f, 0.0f};
+  return &t->doors[t->count++];
+}
+#endif
+
+// Mirrors a door's state into the solid bits of its cell, if that is
+// resident and still holds a door.
+static void door_apply(struct Map *map, const Door *d) {
+  MapChunk *c = map_chunk(map, d->x, d->y);
+  if (c == &missing_chunk ||
+      id_type[c->ids[chunk_cell(d->x, d->y)]] != TILE_TYPE_DOOR)
+    return;
+  uint64_t bit = 1ull << (d->x & (CHUNK_SIZE - 1));
+  if (d->open < DOOR_PASSABLE)
+    c->solid[d->y & (CHUNK_SIZE - 1)] |= bit;
+  else
+    c->solid[d->y & (CHUNK_SIZE - 1)] &= ~bit;
+}
+
+#ifndef RAYCASTER_LIBRARY
+// Starts opening or closing the door at (x, y). Returns 0 if there is none
+// or memory ran out.
+static int map_set_door(struct Map *map, int x, int y, int open) {
+  DoorTable *t = &map->doors;
+  if (map_type(map, x, y) != TILE_TYPE_DOOR)
+    return 0;
+  Door *d = map_door(map, x, y);
+  if (!d && !open)
+    return 1;
+  if (!d && !(d = map_add_door(map, x, y)))
+    return 0;
+  if (d->speed == 0.0f)
+    t->moving[t->moving_count++] = (int)(d - t->doors);
+  d->speed = open ? DOOR_SPEED : -DOOR_SPEED;
+  return 1;
+}
+
+// Moves the doors that are opening or closing by dt seconds. The wall
+// distances don't change, doors stop rays however far open they are.
+static void map_update_doors(struct Map *map, float dt) {
+  DoorTable *t = &map->doors;
+  if (t->moving_count)
+    map->revision++;
+  for (int i = 0; i < t->moving_count;) {
+    Door *d = &t->doors[t->moving[i]];
+    d->open = clampf(d->open + d->speed * dt, 0.0f, 1.0f);
+    door_apply(map, d);
+    if (d->open == (d->speed > 0.0f ? 1.0f : 0.0f)) {
+      d->speed = 0.0f;
+      t->moving[i] = t->moving[--t->moving_count];
+    } else {
+      i++;
+    }
+  }
+}
+#endif
+
+// Calls visit on the wall distance of every cell inside the map at
+// Chebyshev distance k from (cx, cy), returning how many it changed.
+typedef int (*RingVisit)(uint8_t *distance, int k);
+
+#ifndef RAYCASTER_LIBRARY
+static int visit_ring(struct Map *map, int cx, int cy, int k,
+                      RingVisit visit) {
+  int w = (int)map->width, h = (int)map->height;
+  int x0 = cx - k, x1 = cx + k, y0 = cy - k, y1 = cy + k;
+  int changed = 0;
+  for (int x = maxi(x0, 0); x <= mini(x1, w - 1); x++) {
+    if (y0 >= 0)
+      changed += visit(distance_at(map, x, y0), k);
+    if (k > 0 && y1 < h)
+      changed += visit(distance_at(map, x, y1), k);
+  }
+  for (int y = maxi(y0 + 1, 0); y <= mini(y1 - 1, h - 1); y++) {
+    if (x0 >= 0)
+      changed += visit(distance_at(map, x0, y), k);
+    if (x1 < w)
+      changed += visit(distance_at(map, x1, y), k);
+  }
+  return changed;
+}
+
+static int lower_distance(uint8_t *d, int k) {
+  if (*d <= k)
+    return 0;
+  *d = (uint8_t)k;
+  return 1;
+}
+
+static int clear_distance(uint8_t *d, int k) {
+  if (*d != k)
+    return 0;
+  *d = 255;
+  return 1;
+}
+
+// Distances are 1-Lipschitz, so once a ring around a new obstacle has no
+// cell further from a wall than itself, no ring past it has either.
+static void distance_add_obstacle(struct Map *map, int x, int y) {
+  for (int k = 0; visit_ring(map, x, y, k, lower_distance); k++)
+    ;
+}
+
+// The cells whose nearest obstacle was the removed one are exactly that far
+// from it, and each has such a neighbour one ring further in. Clear them
+// ring by ring, then redo the transform over the rings cleared; the cells
+// around keep their distances, which are still correct.
+static void distance_remove_obstacle(struct Map *map, int x, int y) {
+  int r = 0;
+  while (visit_ring(map, x, y, r, clear_distance))
+    r++;
+  int w = (int)map->width, h = (int)map->height;
+  distance_passes(map, maxi(x - r, 0), maxi(y - r, 0), mini(x + r, w - 1),
+                  mini(y + r, h - 1));
+}
+
+// Changes the tile of the cell at (x, y), MAP_NO_TILE clearing it, and
+// updates the solid bits and wall distances around the cell in place. A
+// new door starts closed; decor only becomes a sprite when the map is
+// loaded. Streamed maps can't be edited since their chunks get reloaded.
+static int map_set_cell(struct Map *map, int x, int y, unsigned id) {
+  if (map->stream || (unsigned)x >= map->width ||
+      (unsigned)y >= map->height || id > MAX_TILE_ID)
+    return 0;
+  TileType before = map_type(map, x, y);
+  map_set_id(map, x, y, id);
+
+  // a moving door gets stopped closed by the next update
+  Door *d = before == TILE_TYPE_DOOR ? map_door(map, x, y) : NULL;
+  if (d) {
+    d->open = 0.0f;
+    if (d->speed != 0.0f)
+      d->speed = -DOOR_SPEED;
+  }
+
+  int was_blocking = blocks_rays(before);
+  int blocking = blocks_rays(id_type[id]);
+  if (blocking && !was_blocking)
+    distance_add_obstacle(map, x, y);
+  else if (was_blocking && !blocking)
+    distance_remove_obstacle(map, x, y);
+  map->revision++;
+  return 1;
+}
+#endif
+
+// Background chunk streaming. Chunks are read into a fixed pool of slots
+// sized by MAP_CHUNK_BUDGET_MB. The loader thread only fills slots it is
+// handed; the chunk directory is updated by map_stream_update() on the main
+// thread between frames, so rendering never sees a slot change under it.
+// Resident slots are kept in least recently wanted order and the oldest one
+// is recycled once the pool is full.
+struct MapStream {
+  int fd;
+  uint64_t offset; // of the first chunk in the pack
+  int slot_count;
+  MapChunk *slots;
+  int *slot_chunk; // chunk index per slot, -1 if free
+  int *prev;       // LRU list of resident slots, most recent first
+  int *next;
+  int head;
+  int tail;
+  int *free_slots;
+  int free_count;
+  int *chunk_slot;         // slot per chunk, -1 if neither resident nor loading
+  unsigned *chunk_wanted;  // last update that wanted the chunk
+  unsigned frame;
+
+  SDL_Thread *thread;
+  SDL_mutex *lock;
+  SDL_cond *wake;
+  SDL_cond *idle;
+  int *queue;  // slots waiting to be read, highest priority first
+  int queued;
+  int *loaded; // slots read but not yet in the directory
+  int loaded_count;
+  int busy; // slot being read, -1 if none
+  int quit;
+};
+
+static int map_stream_loader(void *data) {
+  MapStream *st = data;
+  SDL_LockMutex(st->lock);
+  for (;;) {
+    while (!st->quit && st->queued == 0)
+      SDL_CondWait(st->wake, st->lock);
+    if (st->quit)
+      break;
+
+    int slot = st->queue[0];
+    memmove(st->queue, st->queue + 1, --st->queued * sizeof(int));
+    st->busy = slot;
+    uint64_t offset =
+        st->offset + (uint64_t)st->slot_chunk[slot] * sizeof(MapChunk);
+    SDL_UnlockMutex(st->lock);
+
+    ssize_t n = pread(st->fd, &st->slots[slot], sizeof(MapChunk), offset);
+    if (n != (ssize_t)sizeof(MapChunk))
+      st->slots[slot] = missing_chunk;
+
+    SDL_LockMutex(st->lock);
+    st->loaded[st->loaded_count++] = slot;
+    st->busy = -1;
+    if (st->queued == 0)
+      SDL_CondBroadcast(st->idle);
+  }
+  SDL_UnlockMutex(st->lock);
+  return 0;
+}
+
+static void map_stream_destroy(MapStream *st) {
+  if (!st)
+    return;
+  if (st->thread) {
+    SDL_LockMutex(st->lock);
+    st->quit = 1;
+    SDL_CondSignal(st->wake);
+    SDL_UnlockMutex(st->lock);
+    SDL_WaitThread(st->thread, NULL);
+  }
+  if (st->lock)
+    SDL_DestroyMutex(st->lock);
+  if (st->wake)
+    SDL_DestroyCond(st->wake);
+  if (st->idle)
+    SDL_DestroyCond(st->idle);
+  if (st->fd >= 0)
+    close(st->fd);
+  free(st->slots);
+  free(st->slot_chunk);
+  free(st->prev);
+  free(st->next);
+  free(st->free_slots);
+  free(st->chunk_slot);
+  free(st->chunk_wanted);
+  free(st->queue);
+  free(st->loaded);
+  free(st);
+}
+
+static MapStream *map_stream_create(const struct Map *map, const char *path,
+                                    uint64_t offset) {
+  int chunk_count = map->chunks_x * map->chunks_y;
+  MapStream *st = calloc(1, sizeof(MapStream));
+  if (!st)
+    return NULL;
+  st->fd = open(path, O_RDONLY);
+  st->offset = offset;
+  st->slot_count = (int)mini(
+      chunk_count, (int)((size_t)MAP_CHUNK_BUDGET_MB * 1024 * 1024 /
+                         sizeof(MapChunk)));
+  st->slots = malloc((size_t)st->slot_count * sizeof(MapChunk));
+  st->slot_chunk = malloc(st->slot_count * sizeof(int));
+  st->prev = malloc(st->slot_count * sizeof(int));
+  st->next = malloc(st->slot_count * sizeof(int));
+  st->free_slots = malloc(st->slot_count * sizeof(int));
+  st->queue = malloc(st->slot_count * sizeof(int));
+  st->loaded = malloc(st->slot_count * sizeof(int));
+  st->chunk_slot = malloc(chunk_count * sizeof(int));
+  st->chunk_wanted = calloc(chunk_count, sizeof(unsigned));
+  st->head = st->tail = st->busy = -1;
+  st->lock = SDL_CreateMutex();
+  st->wake = SDL_CreateCond();
+  st->idle = SDL_CreateCond();
+  if (st->fd < 0 || !st->slots || !st->slot_chunk || !st->prev || !st->next ||
+      !st->free_slots || !st->queue || !st->loaded || !st->chunk_slot ||
+      !st->chunk_wanted || !st->lock || !st->wake || !st->idle) {
+    fprintf(stderr, "Failed to set up map streaming\n");
+    map_stream_destroy(st);
+    return NULL;
+  }
+
+  for (int i = 0; i < chunk_count; i++)
+    st->chunk_slot[i] = -1;
+  for (int i = 0; i < st->slot_count; i++) {
+    st->slot_chunk[i] = -1;
+    st->free_slots[st->free_count++] = st->slot_count - 1 - i;
+  }
+
+  st->thread = SDL_CreateThread(map_stream_loader, "map loader", st);
+  if (!st->thread) {
+    fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+    map_stream_destroy(st);
+    return NULL;
+  }
+  return st;
+}
+
+static void lru_unlink(MapStream *st, int slot) {
+  if (st->prev[slot] >= 0)
+    st->next[st->prev[slot]] = st->next[slot];
+  else
+    st->head = st->next[slot];
+  if (st->next[slot] >= 0)
+    st->prev[st->next[slot]] = st->prev[slot];
+  else
+    st->tail = st->prev[slot];
+}
+
+static void lru_push_front(MapStream *st, int slot) {
+  st->prev[slot] = -1;
+  st->next[slot] = st->head;
+  if (st->head >= 0)
+    st->prev[st->head] = slot;
+  st->head = slot;
+  if (st->tail < 0)
+    st->tail = slot;
+}
+
+// A free slot, or the least recently wanted resident one unless every
+// resident chunk is still wanted. -1 when there is none.
+static int map_stream_take_slot(struct Map *map) {
+  MapStream *st = map->stream;
+  if (st->free_count > 0)
+    return st->free_slots[--st->free_count];
+
+  int slot = st->tail;
+  if (slot < 0 || st->chunk_wanted[st->slot_chunk[slot]] == st->frame)
+    return -1;
+  lru_unlink(st, slot);
+  int chunk = st->slot_chunk[slot];
+  map->chunks[chunk] = &missing_chunk;
+  st->chunk_slot[chunk] = -1;
+  map->revision++;
+  return slot;
+}
+
+static void map_stream_want(struct Map *map, int cx, int cy) {
+  MapStream *st = map->stream;
+  if ((unsigned)cx >= (unsigned)map->chunks_x ||
+      (unsigned)cy >= (unsigned)map->chunks_y)
+    return;
+  int chunk = cy * map->chunks_x + cx;
+  if (st->chunk_wanted[chunk] == st->frame)
+    return;
+  st->chunk_wanted[chunk] = st->frame;
+
+  int slot = st->chunk_slot[chunk];
+  if (slot >= 0) {
+    if (map->chunks[chunk] != &missing_chunk) {
+      lru_unlink(st, slot);
+      lru_push_front(st, slot);
+    }
+    return;
+  }
+
+  slot = map_stream_take_slot(map);
+  if (slot < 0)
+    return;
+  st->slot_chunk[slot] = chunk;
+  st->chunk_slot[chunk] = slot;
+  st->queue[st->queued++] = slot;
+}
+
+static void map_stream_publish(struct Map *map) {
+  MapStream *st = map->stream;
+  for (int i = 0; i < st->loaded_count; i++) {
+    int slot = st->loaded[i];
+    map->chunks[st->slot_chunk[slot]] = &st->slots[slot];
+    lru_push_front(st, slot);
+  }
+  // chunks come with their doors closed
+  if (st->loaded_count) {
+    for (int i = 0; i < map->doors.count; i++)
+      door_apply(map, &map->doors.doors[i]);
+    map->revision++;
+  }
+  st->loaded_count = 0;
+}
+
+// Publishes the chunks loaded since the last call and queues the ones
+// around the camera, nearest first, then a few ahead of it along the view
+// direction. With wait set it returns once they are all resident. Call it
+// between frames only.
+static void map_stream_update(struct Map *map, const Camera *camera,
+                              int wait) {
+  MapStream *st = map->stream;
+  if (!st)
+    return;
+
+  SDL_LockMutex(st->lock);
+  // drop queued loads that haven't started, their priorities are stale
+  for (int i = 0; i < st->queued; i++) {
+    int slot = st->queue[i];
+    st->chunk_slot[st->slot_chunk[slot]] = -1;
+    st->slot_chunk[slot] = -1;
+    st->free_slots[st->free_count++] = slot;
+  }
+  st->queued = 0;
+  map_stream_publish(map);
+
+  st->frame++;
+  int cx = (int)floorf(camera->pos_x) >> CHUNK_SHIFT;
+  int cy = (int)floorf(camera->pos_y) >> CHUNK_SHIFT;
+  for (int r = 0; r <= CHUNK_PREFETCH_RADIUS; r++)
+    for (int y = cy - r; y <= cy + r; y++)
+      for (int x = cx - r; x <= cx + r; x++)
+        if (maxi(abs(x - cx), abs(y - cy)) == r)
+          map_stream_want(map, x, y);
+  for (int k = 1; k <= CHUNK_LOOKAHEAD; k++) {
+    int ax = (int)floorf(camera->pos_x + camera->dir_x * (float)(k * CHUNK_SIZE));
+    int ay = (int)floorf(camera->pos_y + camera->dir_y * (float)(k * CHUNK_SIZE));
+    for (int y = -1; y <= 1; y++)
+      for (int x = -1; x <= 1; x++)
+        map_stream_want(map, (ax >> CHUNK_SHIFT) + x, (ay >> CHUNK_SHIFT) + y);
+  }
+  if (st->queued > 0)
+    SDL_CondSignal(st->wake);
+
+  if (wait) {
+    while (st->queued > 0 || st->busy >= 0)
+      SDL_CondWait(st->idle, st->lock);
+    map_stream_publish(map);
+  }
+  SDL_UnlockMutex(st->lock);
+}
+
+// Baked pack: the tile table, every mip (and column copy) in ARGB8888, the
+// map chunks and the sprites, each block aligned to PACK_ALIGN. It is a local
+// cache in native byte order, loaded by mapping it and pointing tiles and map
+// chunks straight at the data. Maps over MAP_CHUNK_BUDGET_MB are streamed
+// instead.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_count;
+  uint64_t map_width;
+  uint64_t map_height;
+  uint64_t chunks; // file offset of the row-major MapChunk array
+  uint64_t sprites; // file offset of the Sprite array, 0 if there are none
+  uint64_t sprite_count;
+} PackHeader;
+
+typedef struct {
+  uint32_t id;
+  uint32_t type;
+  uint32_t mip_count;
+  uint32_t reserved;
+  struct {
+    uint32_t width;
+    uint32_t height;
+    uint64_t pixels;
+    uint64_t columns; // 0 for tiles without a column copy
+    uint64_t ceiling; // 0 for tiles without a ceiling copy
+  } mips[MAX_MIP_LEVELS];
+} PackTile;
+
+#ifndef RAYCASTER_LIBRARY
+// Pads the file to PACK_ALIGN and writes a block, returning its offset or 0.
+static uint64_t pack_write(FILE *f, const void *data, size_t size) {
+  static const uint8_t zeros[PACK_ALIGN];
+  long pos = ftell(f);
+  if (pos < 0)
+    return 0;
+  size_t pad = (PACK_ALIGN - (size_t)pos % PACK_ALIGN) % PACK_ALIGN;
+  if (fwrite(zeros, 1, pad, f) != pad || fwrite(data, 1, size, f) != size)
+    return 0;
+  return (uint64_t)pos + pad;
+}
+
+static int bake_pack(const char *path, const struct Map *map) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to create pack file: %s\n", path);
+    return 0;
+  }
+
+  PackHeader header = {.version = PACK_VERSION,
+                       .tile_count = (uint32_t)tile_count,
+                       .map_width = map->width,
+                       .map_height = map->height};
+  memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+  PackTile *table = calloc(tile_count, sizeof(PackTile));
+  int ok = table && fwrite(&header, sizeof(header), 1, f) == 1 &&
+           pack_write(f, table, tile_count * sizeof(PackTile)) != 0;
+
+  for (size_t i = 0; ok && i < tile_count; i++) {
+    const Tile *t = &tile_registry[i];
+    table[i].id = t->id;
+    table[i].type = t->type;
+    table[i].mip_count = (uint32_t)t->mip_count;
+    for (int level = 0; ok && level < t->mip_count; level++) {
+      const TileMip *m = &t->mips[level];
+      size_t bytes = (size_t)m->width * m->height * sizeof(uint32_t);
+      table[i].mips[level].width = (uint32_t)m->width;
+      table[i].mips[level].height = (uint32_t)m->height;
+      ok = (table[i].mips[level].pixels = pack_write(f, m->pixels, bytes));
+      if (ok && m->columns)
+        ok = (table[i].mips[level].columns = pack_write(f, m->columns, bytes));
+      if (ok && m->ceiling)
+        ok = (table[i].mips[level].ceiling = pack_write(f, m->ceiling, bytes));
+    }
+  }
+
+  for (int i = 0; ok && i < map->chunks_x * map->chunks_y; i++) {
+    uint64_t offset = pack_write(f, map->chunks[i], sizeof(MapChunk));
+    ok = offset != 0;
+    if (i == 0)
+      header.chunks = offset;
+  }
+
+  header.sprite_count = (uint64_t)map->sprites.count;
+  if (ok && map->sprites.count)
+    ok = (header.sprites = pack_write(f, map->sprites.sprites,
+                                      map->sprites.count * sizeof(Sprite)));
+
+  // the table goes right after the header, see pack_write
+  long table_offset = (sizeof(header) + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+  ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, f) == 1 &&
+       fseek(f, table_offset, SEEK_SET) == 0 &&
+       fwrite(table, sizeof(PackTile), tile_count, f) == tile_count;
+
+  free(table);
+  if (fclose(f) != 0)
+    ok = 0;
+  if (!ok)
+    fprintf(stderr, "Failed to write pack file: %s\n", path);
+  return ok;
+}
+#endif
+
+// Pointer to size bytes at offset in the mapped pack, NULL if out of range
+static void *pack_block(uint64_t offset, uint64_t size) {
+  if (offset == 0 || offset > pack.size || size > pack.size - offset)
+    return NULL;
+  return (uint8_t *)pack.data + offset;
+}
+
+// Maps a baked pack and sets up the tile registry and map in place. The
+// pages are private, so writes to the map stay in memory.
+static struct Map load_pack(const char *path) {
+  struct Map map = {0};
+
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PackHeader)) {
+    fprintf(stderr, "Failed to open pack file: %s\n", path);
+    if (fd >= 0)
+      close(fd);
+    return map;
+  }
+  pack.size = (size_t)st.st_size;
+  pack.data = mmap(NULL, pack.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (pack.data == MAP_FAILED) {
+    fprintf(stderr, "Failed to map pack file: %s\n", path);
+    pack.data = NULL;
+    return map;
+  }
+
+  const PackHeader *header = pack.data;
+  size_t table_offset =
+      (sizeof(*header) + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+  PackTile *table = NULL;
+  if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic)) == 0 &&
+      header->version == PACK_VERSION)
+    table = pack_block(table_offset,
+                       (uint64_t)header->tile_count * sizeof(PackTile));
+  tile_registry = table ? calloc(header->tile_count, sizeof(Tile)) : NULL;
+  if (!tile_registry)
+    goto fail;
+
+  for (uint32_t i = 0; i < header->tile_count; i++) {
+    const PackTile *pt = &table[i];
+    if (pt->mip_count == 0 || pt->mip_count > MAX_MIP_LEVELS)
+      goto fail;
+    Tile *t = &tile_registry[tile_count++];
+
+    t->id = pt->id;
+    t->type = (TileType)pt->type;
+    t->mip_count = (int)pt->mip_count;
+    for (int level = 0; level < t->mip_count; level++) {
+      TileMip *m = &t->mips[level];
+      m->width = (int)pt->mips[level].width;
+      m->height = (int)pt->mips[level].height;
+      m->kernel = mip_kernel(m->width, m->height);
+      if (!is_pow2(m->width) || !is_pow2(m->height)) {
+        fprintf(stderr, "%s: tile %u is not a power of two, bake it again\n",
+                path, t->id);
+        goto fail;
+      }
+      uint64_t bytes = (uint64_t)m->width * m->height * sizeof(uint32_t);
+      m->pixels = pack_block(pt->mips[level].pixels, bytes);
+      m->columns = pt->mips[level].columns
+                       ? pack_block(pt->mips[level].columns, bytes)
+                       : NULL;
+      m->ceiling = pt->mips[level].ceiling
+                       ? pack_block(pt->mips[level].ceiling, bytes)
+                       : NULL;
+      if (!m->pixels || (pt->mips[level].columns && !m->columns) ||
+          (pt->mips[level].ceiling && !m->ceiling) ||
+          (t->type == TILE_TYPE_FLOOR && !m->ceiling))
+        goto fail;
+    }
+    t->width = t->mips[0].width;
+    t->height = t->mips[0].height;
+    t->pixels = t->mips[0].pixels;
+    t->columns = t->mips[0].columns;
+
+    if (t->id < MAX_TILE_ID) {
+      id_lut[t->id] = t;
+      id_type[t->id] = t->type;
+    }
+  }
+
+  if (header->map_width == 0 || header->map_height == 0 ||
+      header->map_width > INT_MAX / 2 || header->map_height > INT_MAX / 2 ||
+      !map_init_chunks(&map, header->map_width, header->map_height))
+    goto fail;
+  size_t chunk_count = (size_t)map.chunks_x * map.chunks_y;
+  MapChunk *chunks = pack_block(header->chunks, chunk_count * sizeof(MapChunk));
+  if (!chunks || header->sprite_count > INT_MAX / sizeof(Sprite))
+    goto fail;
+
+  // sprites are copied out, they change at runtime
+  const Sprite *sprites =
+      pack_block(header->sprites, header->sprite_count * sizeof(Sprite));
+  if (header->sprite_count && !sprites)
+    goto fail;
+  for (uint64_t i = 0; i < header->sprite_count; i++) {
+    const Sprite *sp = &sprites[i];
+    if (!(sp->x >= 0.0f && sp->x < (float)map.width && sp->y >= 0.0f &&
+          sp->y < (float)map.height) ||
+        !map_add_sprite(&map, sp->x, sp->y, sp->id))
+      goto fail;
+  }
+  if (!sprite_grid_build(&map))
+    goto fail;
+
+  if (chunk_count * sizeof(MapChunk) <=
+      (size_t)MAP_CHUNK_BUDGET_MB * 1024 * 1024) {
+    for (size_t i = 0; i < chunk_count; i++)
+      map.chunks[i] = &chunks[i];
+  } else {
+    // too big to keep around, page chunks in around the camera instead
+    madvise(chunks, chunk_count * sizeof(MapChunk), MADV_DONTNEED);
+    map.stream = map_stream_create(&map, path, header->chunks);
+    if (!map.stream)
+      goto fail;
+  }
+
+  return map;
+
+fail:
+  fprintf(stderr, "Invalid pack file: %s\n", path);
+  free_map(&map);
+  free_tile_registry();
+  return (struct Map){0};
+}
+
+// Starts decoding the manifest's textures, the ones used most by the
+// cells and ceilings of the resident part of the map first.
+static int tile_loader_start(const struct Map *map) {
+  static unsigned uses[MAX_TILE_ID + 1];
+  memset(uses, 0, sizeof(uses));
+  for (int i = 0; i < map->chunks_x * map->chunks_y; i++) {
+    const MapChunk *chunk = map->chunks[i];
+    if (chunk == &missing_chunk)
+      continue;
+    for (int c = 0; c < CHUNK_SIZE * CHUNK_SIZE; c++) {
+      uses[chunk->ids[c]]++;
+      // any other ceiling id is open sky
+      if (id_type[chunk->ceiling[c]] == TILE_TYPE_FLOOR)
+        uses[chunk->ceiling[c]]++;
+    }
+  }
+
+  tile_loader.order = malloc(tile_count * sizeof(int));
+  tile_loader.ready = calloc(tile_count, sizeof(Tile));
+  tile_loader.pending = calloc(tile_count, 1);
+  tile_loader.lock = SDL_CreateMutex();
+  tile_loader.decoded = SDL_CreateCond();
+  int threads = mini(maxi(SDL_GetCPUCount(), 1), (int)tile_count);
+  tile_loader.threads = calloc(threads, sizeof(SDL_Thread *));
+  if (!tile_loader.order || !tile_loader.ready || !tile_loader.pending ||
+      !tile_loader.lock || !tile_loader.decoded || !tile_loader.threads) {
+    fprintf(stderr, "Failed to start the texture loader\n");
+    return 0;
+  }
+
+  // insertion sort by use count, entries keep manifest order among equals
+  for (int i = 0; i < (int)tile_count; i++) {
+    unsigned id = tile_loader.entries[i].id;
+    unsigned n = id < MAX_TILE_ID ? uses[id] : 0;
+    int j = i;
+    for (; j > 0; j--) {
+      unsigned prev = tile_loader.entries[tile_loader.order[j - 1]].id;
+      if ((prev < MAX_TILE_ID ? uses[prev] : 0) >= n)
+        break;
+      tile_loader.order[j] = tile_loader.order[j - 1];
+    }
+    tile_loader.order[j] = i;
+  }
+
+  tile_loader.remaining = (int)tile_count;
+  for (int i = 0; i < threads; i++) {
+    tile_loader.threads[i] = SDL_CreateThread(tile_decoder, "tile decoder", NULL);
+    if (!tile_loader.threads[i]) {
+      if (i == 0) {
+        fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+        return 0;
+      }
+      break;
+    }
+    tile_loader.thread_count++;
+  }
+  return 1;
+}
+
+// Loads tiles and map from a baked pack when given one, otherwise from the
+// tile manifest and map text file, or a generated synthetic x synthetic map
+// if that isn't 0. Textures from the manifest keep loading in the
+// background, see tile_loader_wait().
+static int load_world(const char *pack_path, int synthetic, struct Map *map) {
+  if (pack_path) {
+    *map = load_pack(pack_path);
+    return map->chunks != NULL;
+  }
+
+  load_tiles(TILE_MANIFEST);
+  if (!tile_registry || tile_count == 0) {
+    fprintf(stderr, "Failed to load tiles from manifest: %s\n", TILE_MANIFEST);
+    return 0;
+  }
+
+  *map = synthetic ? generate_map(synthetic, SYNTHETIC_SEED)
+                   : load_map(MAP_PATH);
+  if (!map->chunks) {
+    fprintf(stderr, "Memory allocation failed for map tiles\n");
+    return 0;
+  }
+  return tile_loader_start(map);
+}
+
+#ifndef RAYCASTER_LIBRARY
+static void rotate_camera(Camera *camera, float rad) {
+  float cos_rad = cosf(rad);
+  float sin_rad = sinf(rad);
+
+  float new_dir_x = camera->dir_x * cos_rad - camera->dir_y * sin_rad;
+  float new_dir_y = camera->dir_x * sin_rad + camera->dir_y * cos_rad;
+  float new_plane_x = camera->plane_x * cos_rad - camera->plane_y * sin_rad;
+  float new_plane_y = camera->plane_x * sin_rad + camera->plane_y * cos_rad;
+
+  camera->dir_x = new_dir_x;
+  camera->dir_y = new_dir_y;
+  camera->plane_x = new_plane_x;
+  camera->plane_y = new_plane_y;
+}
+#endif
+
+// Solid bits of the 5x5 cells around (x, y), bit (dy + 2) * 5 + (dx + 2)
+// for the cell (x + dx, y + dy). Rows are read from the solid bitmask five
+// cells at a time unless they cross a chunk or the map edge.
+static uint32_t solid_block(const struct Map *map, int x, int y) {
+  uint32_t block = 0;
+  int shared = x >= 2 && (size_t)x + 2 < map->width &&
+               ((x - 2) >> CHUNK_SHIFT) == ((x + 2) >> CHUNK_SHIFT);
+  for (int dy = -2; dy <= 2; dy++) {
+    int row = y + dy;
+    uint32_t bits = 0;
+    if (shared && (unsigned)row < map->height) {
+      bits = (uint32_t)(map_chunk(map, x, row)->solid[row & (CHUNK_SIZE - 1)] >>
+                        ((x - 2) & (CHUNK_SIZE - 1))) &
+             0x1F;
+    } else {
+      for (int dx = -2; dx <= 2; dx++)
+        bits |= (uint32_t)is_solid(map, x + dx, row) << (dx + 2);
+    }
+    block |= bits << ((dy + 2) * 5);
+  }
+  return block;
+}
+
+// Whether any cell in [x0, x1] x [y0, y1] is solid, a row of up to a chunk
+// at a time.
+static int solid_box(const struct Map *map, int x0, int y0, int x1, int y1) {
+  int shared = x0 >= 0 && (size_t)x1 < map->width &&
+               (x0 >> CHUNK_SHIFT) == (x1 >> CHUNK_SHIFT);
+  uint64_t mask = shared ? (~0ull >> (63 - (x1 - x0))) << (x0 & (CHUNK_SIZE - 1))
+                         : 0;
+  for (int y = y0; y <= y1; y++) {
+    if (shared && (unsigned)y < map->height) {
+      if (map_chunk(map, x0, y)->solid[y & (CHUNK_SIZE - 1)] & mask)
+        return 1;
+      continue;
+    }
+    for (int x = x0; x <= x1; x++)
+      if (is_solid(map, x, y))
+        return 1;
+  }
+  return 0;
+}
+
+// Sides of a solid cell that face open cells, walls and doors only get in
+// the way there.
+enum { OPEN_LEFT = 1, OPEN_RIGHT = 2, OPEN_TOP = 4, OPEN_BOTTOM = 8 };
+
+// Earliest time in [0, *t) at which a circle of radius r moving from
+// (px, py) by (dx, dy) touches the cell (x, y) from one of its open sides,
+// stored in *t with the contact normal. Cells the circle already overlaps
+// don't stop it, so it can always get out of a door that closed on it.
+static void sweep_cell(float px, float py, float dx, float dy, float r, int x,
+                       int y, unsigned open, float *t, float *nx, float *ny) {
+  // faces, the cell grown by r along one axis
+  if (dx != 0.0f && (open & (dx > 0.0f ? OPEN_LEFT : OPEN_RIGHT))) {
+    float face = dx > 0.0f ? (float)x - r : (float)x + 1.0f + r;
+    float gap = dx > 0.0f ? face - px : px - face;
+    float hit = fmaxf(0.0f, (face - px) / dx);
+    float hy = py + dy * hit;
+    if (gap > -COLLISION_SKIN && hit < *t && hy >= (float)y &&
+        hy <= (float)y + 1.0f) {
+      *t = hit;
+      *nx = dx > 0.0f ? -1.0f : 1.0f;
+      *ny = 0.0f;
+    }
+  }
+  if (dy != 0.0f && (open & (dy > 0.0f ? OPEN_TOP : OPEN_BOTTOM))) {
+    float face = dy > 0.0f ? (float)y - r : (float)y + 1.0f + r;
+    float gap = dy > 0.0f ? face - py : py - face;
+    float hit = fmaxf(0.0f, (face - py) / dy);
+    float hx = px + dx * hit;
+    if (gap > -COLLISION_SKIN && hit < *t && hx >= (float)x &&
+        hx <= (float)x + 1.0f) {
+      *t = hit;
+      *nx = 0.0f;
+      *ny = dy > 0.0f ? -1.0f : 1.0f;
+    }
+  }
+
+  // corners with both sides open, circles of radius r around them
+  float a = dx * dx + dy * dy;
+  for (int corner = 0; corner < 4; corner++) {
+    unsigned sides = (corner & 1 ? OPEN_RIGHT : OPEN_LEFT) |
+                     (corner & 2 ? OPEN_BOTTOM : OPEN_TOP);
+    if ((open & sides) != sides)
+      continue;
+    float mx = px - (float)(x + (corner & 1));
+    float my = py - (float)(y + (corner >> 1));
+    float b = mx * dx + my * dy;
+    float c = mx * mx + my * my - r * r;
+    if (b >= 0.0f)
+      continue;
+    if (c <= 0.0f) {
+      float dist = sqrtf(mx * mx + my * my);
+      if (dist < r - COLLISION_SKIN || dist == 0.0f)
+        continue;
+      *t = 0.0f;
+      *nx = mx / dist;
+      *ny = my / dist;
+      continue;
+    }
+    float disc = b * b - a * c;
+    if (disc < 0.0f)
+      continue;
+    float hit = (-b - sqrtf(disc)) / a;
+    if (hit < *t) {
+      *t = hit;
+      *nx = (mx + dx * hit) / r;
+      *ny = (my + dy * hit) / r;
+    }
+  }
+}
+
+// Earliest contact of a circle of radius r (below 1) moving from (px, py)
+// by (dx, dy) with a solid cell, as a share of the move, 1 if there is none.
+// One DDA pass walks the cells the center crosses; the circle can only
+// touch the 3x3 cells around the one its center is in, and only those in
+// the box the whole move sweeps are tested. The tests run relative to the
+// first cell, where floats are precise enough for the skin.
+static float sweep_circle(const struct Map *map, float px, float py, float dx,
+                          float dy, float r, float *nx, float *ny) {
+  int x0 = (int)floorf(px), y0 = (int)floorf(py);
+  int x = x0, y = y0;
+  px -= (float)x0;
+  py -= (float)y0;
+  int step_x = sgnf(dx), step_y = sgnf(dy);
+  float delta_x = inv_abs(dx), delta_y = inv_abs(dy);
+  float next_x = (dx > 0.0f ? 1.0f - px : px) * delta_x;
+  float next_y = (dy > 0.0f ? 1.0f - py : py) * delta_y;
+  float min_x = fminf(px, px + dx) - r, max_x = fmaxf(px, px + dx) + r;
+  float min_y = fminf(py, py + dy) - r, max_y = fmaxf(py, py + dy) + r;
+
+  // broadphase, most moves sweep no solid cell at all
+  if (!solid_box(map, x0 + (int)floorf(min_x), y0 + (int)floorf(min_y),
+                 x0 + (int)floorf(max_x), y0 + (int)floorf(max_y)))
+    return 1.0f;
+
+  float t = 1.0f;
+  for (int steps = 0; steps < MAP_MAX_STEPS; steps++) {
+    uint32_t block = solid_block(map, x, y);
+    for (int j = 1; j <= 3; j++) {
+      for (int i = 1; i <= 3; i++) {
+        int bit = j * 5 + i;
+        int cx = x - x0 + i - 2, cy = y - y0 + j - 2;
+        if (!(block >> bit & 1) || (float)cx >= max_x ||
+            (float)cx + 1.0f <= min_x || (float)cy >= max_y ||
+            (float)cy + 1.0f <= min_y)
+          continue;
+        unsigned open = (block >> (bit - 1) & 1 ? 0 : OPEN_LEFT) |
+                        (block >> (bit + 1) & 1 ? 0 : OPEN_RIGHT) |
+                        (block >> (bit - 5) & 1 ? 0 : OPEN_TOP) |
+                        (block >> (bit + 5) & 1 ? 0 : OPEN_BOTTOM);
+        sweep_cell(px, py, dx, dy, r, cx, cy, open, &t, nx, ny);
+      }
+    }
+
+    // contacts after the center leaves the cell are found from the next
+    float leave = fminf(next_x, next_y);
+    if (t <= leave || leave >= 1.0f)
+      break;
+    if (next_x < next_y) {
+      x += step_x;
+      next_x += delta_x;
+    } else {
+      y += step_y;
+      next_y += delta_y;
+    }
+  }
+  return t;
+}
+
+// Moves a circle of radius r by (dx, dy), stopping at solid cells and
+// sliding along them for what is left of the move.
+static void move_circle(const struct Map *map, float *px, float *py, float dx,
+                        float dy, float r) {
+  for (int slide = 0; slide < MAX_SLIDES; slide++) {
+    if (fabsf(dx) + fabsf(dy) < 1e-7f)
+      return;
+
+    float nx = 0.0f, ny = 0.0f;
+    float t = sweep_circle(map, *px, *py, dx, dy, r, &nx, &ny);
+    *px += dx * t + nx * COLLISION_SKIN;
+    *py += dy * t + ny * COLLISION_SKIN;
+    if (t >= 1.0f)
+      return;
+
+    // what is left, without the part into the wall
+    dx *= 1.0f - t;
+    dy *= 1.0f - t;
+    float into = dx * nx + dy * ny;
+    dx -= nx * into;
+    dy -= ny * into;
+  }
+}
+
+#ifndef RAYCASTER_LIBRARY
+static void move_camera(Camera *cam, const struct Map *map, float dir_x,
+                        float dir_y, float speed) {
+  float len = hypotf(dir_x, dir_y);
+  if (len == 0.0f)
+    return;
+  move_circle(map, &cam->pos_x, &cam->pos_y, dir_x / len * speed,
+              dir_y / len * speed, CAMERA_RADIUS);
+
+#if DEBUG
+  if (is_solid(map, (int)cam->pos_x, (int)cam->pos_y))
+    fprintf(stderr, "inside wall @ (%.2f, %.2f)\n", cam->pos_x, cam->pos_y);
+#endif
+}
+#endif
+
+static inline int same_camera(const Camera *a, const Camera *b) {
+  return a->pos_x == b->pos_x && a->pos_y == b->pos_y &&
+         a->dir_x == b->dir_x && a->dir_y == b->dir_y &&
+         a->plane_x == b->plane_x && a->plane_y == b->plane_y;
+}
+
+#ifndef RAYCASTER_LIBRARY
+// The view a fraction t of the way from simulation step a to b. Direction
+// and plane are scaled back to b's length so the view doesn't narrow while
+// turning.
+static Camera lerp_camera(const Camera *a, const Camera *b, float t) {
+  if (same_camera(a, b))
+    return *b;
+
+  Camera c = {
+      .pos_x = a->pos_x + (b->pos_x - a->pos_x) * t,
+      .pos_y = a->pos_y + (b->pos_y - a->pos_y) * t,
+      .dir_x = a->dir_x + (b->dir_x - a->dir_x) * t,
+      .dir_y = a->dir_y + (b->dir_y - a->dir_y) * t,
+      .plane_x = a->plane_x + (b->plane_x - a->plane_x) * t,
+      .plane_y = a->plane_y + (b->plane_y - a->plane_y) * t,
+  };
+
+  float dir = hypotf(c.dir_x, c.dir_y);
+  float plane = hypotf(c.plane_x, c.plane_y);
+  if (dir > 0.0f && plane > 0.0f) {
+    float ds = hypotf(b->dir_x, b->dir_y) / dir;
+    float ps = hypotf(b->plane_x, b->plane_y) / plane;
+    c.dir_x *= ds;
+    c.dir_y *= ds;
+    c.plane_x *= ps;
+    c.plane_y *= ps;
+  }
+  return c;
+}
+
+// Advances the camera by one simulation step of dt seconds from the keys
+// held down.
+static void simulate_camera(Camera *camera, const struct Map *map,
+                            const Uint8 *kb, float dt) {
+  float move_speed = MOVE_SPEED_SEC * dt;
+  float rot_speed = ROT_SPEED_SEC * dt;
+
+  if (kb[SDL_SCANCODE_LEFT])
+    rotate_camera(camera, rot_speed);
+  if (kb[SDL_SCANCODE_RIGHT])
+    rotate_camera(camera, -rot_speed);
+  if (kb[SDL_SCANCODE_W])
+    move_camera(camera, map, camera->dir_x, camera->dir_y, move_speed);
+  if (kb[SDL_SCANCODE_S])
+    move_camera(camera, map, camera->dir_x, camera->dir_y, -move_speed);
+  if (kb[SDL_SCANCODE_A])
+    move_camera(camera, map, camera->dir_y, -camera->dir_x, -move_speed);
+  if (kb[SDL_SCANCODE_D])
+    move_camera(camera, map, camera->dir_y, -camera->dir_x, move_speed);
+}
+
+// Whether the simulation has anything to step: a key held that moves the
+// camera, or a door opening or closing.
+static int simulation_idle(const struct Map *map, const Uint8 *kb) {
+  return !kb[SDL_SCANCODE_LEFT] && !kb[SDL_SCANCODE_RIGHT] &&
+         !kb[SDL_SCANCODE_W] && !kb[SDL_SCANCODE_S] && !kb[SDL_SCANCODE_A] &&
+         !kb[SDL_SCANCODE_D] && map->doors.moving_count == 0;
+}
+
+// Opens the door in the cell ahead of the camera, or closes it if it is
+// open or opening.
+static void use_door(struct Map *map, const Camera *cam) {
+  int x = (int)floorf(cam->pos_x + cam->dir_x * DOOR_REACH);
+  int y = (int)floorf(cam->pos_y + cam->dir_y * DOOR_REACH);
+  const Door *d = map_door(map, x, y);
+  int open = d && (d->speed > 0.0f || (d->speed == 0.0f && d->open > 0.0f));
+  map_set_door(map, x, y, !open);
+}
+
+// Knocks out the wall in the cell ahead of the camera, leaving the floor the
+// camera stands on, or builds a wall of the last one knocked out there.
+static void edit_cell(struct Map *map, const Camera *cam, unsigned *wall_id) {
+  int x = (int)floorf(cam->pos_x + cam->dir_x * DOOR_REACH);
+  int y = (int)floorf(cam->pos_y + cam->dir_y * DOOR_REACH);
+  int cx = (int)floorf(cam->pos_x), cy = (int)floorf(cam->pos_y);
+  if (map_type(map, cx, cy) != TILE_TYPE_FLOOR || (x == cx && y == cy))
+    return;
+  for (size_t i = 0; *wall_id == MAP_NO_TILE && i < tile_count; i++)
+    if (tile_registry[i].type == TILE_TYPE_WALL)
+      *wall_id = tile_registry[i].id;
+
+  TileType type = map_type(map, x, y);
+  if (type == TILE_TYPE_WALL) {
+    *wall_id = map_chunk(map, x, y)->ids[chunk_cell(x, y)];
+    map_set_cell(map, x, y, map_chunk(map, cx, cy)->ids[chunk_cell(cx, cy)]);
+  } else if (type == TILE_TYPE_FLOOR && *wall_id != MAP_NO_TILE) {
+    map_set_cell(map, x, y, *wall_id);
+  }
+}
+#endif
+
+// Light falls off as exp(-FOG_FACTOR * distance), the rest is FOG_COLOR.
+// Distances are quantized into FOG_LEVELS levels with a precomputed channel
+// scale and fog colour each, so shading a texel is a packed multiply and an
+// add. Levels are spaced so the last leaves less than 1/256 of the light.
+typedef struct {
+  uint32_t scale; // 0..256, applied to every channel
+  uint32_t fog;   // share of FOG_COLOR added on top
+} Light;
+
+static struct {
+  Light levels[FOG_LEVELS];
+  float levels_per_unit;
+} lighting;
+
+static inline uint32_t scale_color(uint32_t color, uint32_t scale) {
+  uint32_t rb = ((color & 0xFF00FFu) * scale >> 8) & 0xFF00FFu;
+  uint32_t g = ((color & 0x00FF00u) * scale >> 8) & 0x00FF00u;
+  return rb | g;
+}
+
+// Returns the shaded colour without alpha. The scaled texel and the fog
+// share never add up to more than 255 per channel.
+static inline uint32_t shade(uint32_t color, Light light) {
+  return scale_color(color, light.scale) + light.fog;
+}
+
+static void init_lighting(void) {
+  lighting.levels_per_unit = FOG_LEVELS * FOG_FACTOR / logf(256.0f);
+  for (int i = 0; i < FOG_LEVELS; i++) {
+#if DISTANCE_FOG
+    float distance = i / lighting.levels_per_unit;
+    uint32_t scale = (uint32_t)(256.0f * expf(-FOG_FACTOR * distance) + 0.5f);
+#else
+    uint32_t scale = 256;
+#endif
+    lighting.levels[i] = (Light){scale, scale_color(FOG_COLOR, 256 - scale)};
+  }
+}
+
+// The middle row of odd heights sits just above the horizon and comes with
+// a negative distance, it gets full light.
+static inline Light light_at(float distance) {
+  float level =
+      fminf(fmaxf(distance * lighting.levels_per_unit, 0.0f), FOG_LEVELS - 1);
+  return lighting.levels[(int)level];
+}
+
+static float *generate_camera_lut(int width) {
+  float *lut = (float *)malloc(width * sizeof(float));
+  if (!lut)
+    return NULL;
+
+  for (int i = 0; i < width; i++)
+    lut[i] = (2.0f * i / width) - 1.0f;
+
+  return lut;
+}
+
+typedef struct {
+  uint8_t *pixels;
+  int pitch; // bytes per row
+  int width;
+  int height;
+} Framebuffer;
+
+static void vertical_line(const Framebuffer *fb, int x, int y0, int y1,
+                          uint32_t color) {
+  y0 = maxi(0, y0);
+  y1 = mini(fb->height - 1, y1);
+
+  uint8_t *row = fb->pixels + (size_t)y0 * fb->pitch + x * 4;
+  for (int y = y0; y <= y1; y++) {
+    *(uint32_t *)row = color;
+    row += fb->pitch;
+  }
+}
+
+typedef enum {
+  SCOPE_FRAME,
+  SCOPE_LOCK,
+  SCOPE_FLOOR,
+  SCOPE_WALLS,
+  SCOPE_SPRITES,
+  SCOPE_UPLOAD,
+  SCOPE_PRESENT,
+  SCOPE_HUD,
+  SCOPE_COUNT,
+} ProfileScope;
+
+static const char *const scope_names[SCOPE_COUNT] = {
+    "frame", "lock", "floor", "walls", "sprites", "upload", "present", "hud",
+};
+
+typedef struct {
+  Uint64 start[SCOPE_COUNT];
+  Uint64 ticks[SCOPE_COUNT];
+} ProfileFrame;
+
+// Timings of the last PROFILER_HISTORY frames, written from the main thread
+// only. Optionally every scope is also streamed as a Chrome trace event.
+// Other threads time their scopes into a frame of their own, which the main
+// thread merges once it collects their work.
+typedef struct {
+  ProfileFrame frames[PROFILER_HISTORY];
+  unsigned frame; // frames begun so far
+  FILE *trace;
+  Uint64 trace_origin;
+  int trace_events;
+} Profiler;
+
+static Profiler profiler;
+static _Thread_local ProfileFrame *profile_thread_frame;
+
+static inline ProfileFrame *profile_current(void) {
+  if (profile_thread_frame)
+    return profile_thread_frame;
+  return &profiler.frames[profiler.frame % PROFILER_HISTORY];
+}
+
+static inline void profile_begin(ProfileScope scope) {
+  profile_current()->start[scope] = SDL_GetPerformanceCounter();
+}
+
+static void profile_trace(ProfileScope scope, Uint64 start, Uint64 ticks,
+                          int tid) {
+  double us_per_tick = 1e6 / (double)SDL_GetPerformanceFrequency();
+  fprintf(profiler.trace,
+          "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+          "\"ts\": %.3f, \"dur\": %.3f}",
+          profiler.trace_events++ ? "," : "", scope_names[scope], tid,
+          (start - profiler.trace_origin) * us_per_tick, ticks * us_per_tick);
+}
+
+// A scope entered more than once in a frame adds up.
+static inline void profile_end(ProfileScope scope) {
+  ProfileFrame *f = profile_current();
+  Uint64 ticks = SDL_GetPerformanceCounter() - f->start[scope];
+  f->ticks[scope] += ticks;
+  if (profiler.trace && !profile_thread_frame)
+    profile_trace(scope, f->start[scope], ticks, 1);
+}
+
+#ifndef RAYCASTER_LIBRARY
+// Adds the scopes another thread timed into f to the current frame, traced
+// as thread tid.
+static void profile_merge(const ProfileFrame *f, int tid) {
+  ProfileFrame *current = profile_current();
+  for (int scope = 0; scope < SCOPE_COUNT; scope++) {
+    if (!f->ticks[scope])
+      continue;
+    if (!current->ticks[scope] || f->start[scope] < current->start[scope])
+      current->start[scope] = f->start[scope];
+    current->ticks[scope] += f->ticks[scope];
+    if (profiler.trace)
+      profile_trace(scope, f->start[scope], f->ticks[scope], tid);
+  }
+}
+
+static void profile_frame_begin(void) {
+  profiler.frame++;
+  memset(profile_current(), 0, sizeof(ProfileFrame));
+  profile_begin(SCOPE_FRAME);
+}
+
+static void profile_frame_end(void) { profile_end(SCOPE_FRAME); }
+
+// Average of the given scope over the last n completed frames, in ms.
+static float profile_average_ms(ProfileScope scope, unsigned n) {
+  n = n < profiler.frame ? n : profiler.frame;
+  n = n < PROFILER_HISTORY - 1 ? n : PROFILER_HISTORY - 1;
+  if (n == 0)
+    return 0.0f;
+
+  Uint64 sum = 0;
+  for (unsigned i = 1; i <= n; i++)
+    sum += profiler.frames[(profiler.frame - i) % PROFILER_HISTORY].ticks[scope];
+  return (float)(sum * 1000.0 / (double)SDL_GetPerformanceFrequency() / n);
+}
+
+static int profile_open_trace(const char *filename) {
+  profiler.trace = fopen(filename, "w");
+  if (!profiler.trace) {
+    fprintf(stderr, "Failed to open trace file: %s\n", filename);
+    return 0;
+  }
+  profiler.trace_origin = SDL_GetPerformanceCounter();
+  profiler.trace_events = 0;
+  fprintf(profiler.trace, "{\"traceEvents\": [");
+  return 1;
+}
+
+static void profile_close_trace(void) {
+  if (!profiler.trace)
+    return;
+  fprintf(profiler.trace, "\n]}\n");
+  fclose(profiler.trace);
+  profiler.trace = NULL;
+}
+
+// Printable ASCII, rasterized once into a single texture so HUD text costs
+// one SDL_RenderCopy per glyph and no allocations per frame.
+typedef struct {
+  SDL_Texture *texture;
+  SDL_Rect glyphs[HUD_LAST_GLYPH - HUD_FIRST_GLYPH + 1];
+  int advance[HUD_LAST_GLYPH - HUD_FIRST_GLYPH + 1];
+  int line_height;
+} GlyphAtlas;
+
+static void hud_destroy(GlyphAtlas *atlas) {
+  SDL_DestroyTexture(atlas->texture);
+  memset(atlas, 0, sizeof(*atlas));
+}
+
+static int hud_init(GlyphAtlas *atlas, SDL_Renderer *renderer,
+                    TTF_Font *font) {
+  const SDL_Color white = {255, 255, 255, 255};
+  const int glyph_count = HUD_LAST_GLYPH - HUD_FIRST_GLYPH + 1;
+  SDL_Surface *surfs[HUD_LAST_GLYPH - HUD_FIRST_GLYPH + 1] = {NULL};
+  SDL_Surface *sheet = NULL;
+  int ok = 0;
+
+  memset(atlas, 0, sizeof(*atlas));
+  atlas->line_height = TTF_FontHeight(font);
+
+  // shelf-pack the glyphs into rows of HUD_ATLAS_WIDTH pixels
+  int x = 0, y = 0, row_h = 0;
+  for (int i = 0; i < glyph_count; i++) {
+    Uint16 ch = (Uint16)(HUD_FIRST_GLYPH + i);
+    if (TTF_GlyphMetrics(font, ch, NULL, NULL, NULL, NULL,
+                         &atlas->advance[i]) != 0)
+      atlas->advance[i] = 0;
+
+    surfs[i] = TTF_RenderGlyph_Blended(font, ch, white);
+    if (!surfs[i])
+      continue; // e.g. the font has no such glyph
+
+    if (x + surfs[i]->w > HUD_ATLAS_WIDTH) {
+      x = 0;
+      y += row_h + 1;
+      row_h = 0;
+    }
+    atlas->glyphs[i] = (SDL_Rect){x, y, surfs[i]->w, surfs[i]->h};
+    x += surfs[i]->w + 1;
+    row_h = maxi(row_h, surfs[i]->h);
+  }
+
+  sheet = SDL_CreateRGBSurfaceWithFormat(0, HUD_ATLAS_WIDTH, maxi(1, y + row_h),
+                                         32, SDL_PIXELFORMAT_ARGB8888);
+  if (!sheet) {
+    fprintf(stderr, "SDL_CreateRGBSurfaceWithFormat Error: %s\n",
+            SDL_GetError());
+    goto cleanup;
+  }
+  SDL_FillRect(sheet, NULL, 0);
+
+  for (int i = 0; i < glyph_count; i++) {
+    if (!surfs[i])
+      continue;
+    SDL_SetSurfaceBlendMode(surfs[i], SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(surfs[i], NULL, sheet, &atlas->glyphs[i]);
+  }
+
+  atlas->texture = SDL_CreateTextureFromSurface(renderer, sheet);
+  if (!atlas->texture) {
+    fprintf(stderr, "SDL_CreateTextureFromSurface Error: %s\n", SDL_GetError());
+    goto cleanup;
+  }
+  SDL_SetTextureBlendMode(atlas->texture, SDL_BLENDMODE_BLEND);
+  ok = 1;
+
+cleanup:
+  for (int i = 0; i < glyph_count; i++)
+    SDL_FreeSurface(surfs[i]);
+  SDL_FreeSurface(sheet);
+  return ok;
+}
+
+static int hud_text_width(const GlyphAtlas *atlas, const char *text) {
+  int w = 0;
+  for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+    if (*c >= HUD_FIRST_GLYPH && *c <= HUD_LAST_GLYPH)
+      w += atlas->advance[*c - HUD_FIRST_GLYPH];
+  }
+  return w;
+}
+
+// Draws text with its top left corner at (x, y) and returns its width.
+static int hud_text(const GlyphAtlas *atlas, SDL_Renderer *renderer, int x,
+                    int y, const char *text) {
+  int pen = x;
+  for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+    if (*c < HUD_FIRST_GLYPH || *c > HUD_LAST_GLYPH)
+      continue;
+
+    int i = *c - HUD_FIRST_GLYPH;
+    const SDL_Rect *src = &atlas->glyphs[i];
+    if (src->w > 0) {
+      SDL_Rect dst = {pen, y, src->w, src->h};
+      SDL_RenderCopy(renderer, atlas->texture, src, &dst);
+    }
+    pen += atlas->advance[i];
+  }
+  return pen - x;
+}
+
+static int hud_textf(const GlyphAtlas *atlas, SDL_Renderer *renderer, int x,
+                     int y, const char *fmt, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  return hud_text(atlas, renderer, x, y, text);
+}
+
+static void render_fps(SDL_Renderer *renderer, const GlyphAtlas *atlas,
+                       float fps) {
+  char fps_text[64];
+  snprintf(fps_text, sizeof(fps_text), "FPS: %.1f", fps);
+
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 128);
+  SDL_Rect bg = {8, 8, hud_text_width(atlas, fps_text) + 4,
+                 atlas->line_height + 4};
+  SDL_RenderFillRect(renderer, &bg);
+
+  hud_text(atlas, renderer, 10, 10, fps_text);
+}
+
+// Rolling average of every scope plus a bar graph of the frame times in the
+// history, with a marker at 16.6 ms.
+static void render_profiler(SDL_Renderer *renderer, const GlyphAtlas *atlas) {
+  const int x = 8, y = 40;
+  const int line = atlas->line_height + 4;
+  const int graph_h = 80;
+  const float graph_ms = 33.3f; // full graph height
+  const double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+
+  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+  SDL_Rect bg = {x, y, PROFILER_HISTORY * 2 + 8,
+                 SCOPE_COUNT * line + graph_h + 12};
+  SDL_RenderFillRect(renderer, &bg);
+
+  for (int i = 0; i < SCOPE_COUNT; i++)
+    hud_textf(atlas, renderer, x + 4, y + 4 + i * line, "%-8s %6.2f ms",
+              scope_names[i], profile_average_ms(i, PROFILER_AVERAGE));
+
+  SDL_Rect bars[PROFILER_HISTORY];
+  int bar_count = 0;
+  int base = y + 8 + SCOPE_COUNT * line + graph_h;
+  for (unsigned i = 1; i < PROFILER_HISTORY && i <= profiler.frame; i++) {
+    const ProfileFrame *f =
+        &profiler.frames[(profiler.frame - i) % PROFILER_HISTORY];
+    float ms = (float)(f->ticks[SCOPE_FRAME] * ms_per_tick);
+    int bar_h = (int)(clampf(ms / graph_ms, 0.0f, 1.0f) * graph_h);
+    bars[bar_count++] = (SDL_Rect){x + 4 + (PROFILER_HISTORY - 1 - i) * 2,
+                                   base - bar_h, 2, bar_h};
+  }
+  SDL_SetRenderDrawColor(renderer, 80, 200, 120, 220);
+  SDL_RenderFillRects(renderer, bars, bar_count);
+
+  int budget_y = base - (int)(16.6f / graph_ms * graph_h);
+  SDL_SetRenderDrawColor(renderer, 220, 80, 80, 220);
+  SDL_RenderDrawLine(renderer, x + 4, budget_y, x + 4 + PROFILER_HISTORY * 2,
+                     budget_y);
+}
+#endif
+
+typedef struct {
+  SDL_mutex *lock;
+  SDL_cond *cond;
+  int count;
+  int waiting;
+  unsigned phase;
+} Barrier;
+
+static int barrier_init(Barrier *b, int count) {
+  b->lock = SDL_CreateMutex();
+  b->cond = SDL_CreateCond();
+  b->count = count;
+  b->waiting = 0;
+  b->phase = 0;
+  return b->lock && b->cond;
+}
+
+static void barrier_destroy(Barrier *b) {
+  SDL_DestroyCond(b->cond);
+  SDL_DestroyMutex(b->lock);
+  b->cond = NULL;
+  b->lock = NULL;
+}
+
+static void barrier_wait(Barrier *b) {
+  SDL_LockMutex(b->lock);
+  unsigned phase = b->phase;
+  if (++b->waiting >= b->count) {
+    b->waiting = 0;
+    b->phase++;
+    SDL_CondBroadcast(b->cond);
+  } else {
+    while (phase == b->phase)
+      SDL_CondWait(b->cond, b->lock);
+  }
+  SDL_UnlockMutex(b->lock);
+}
+
+typedef void (*PoolJob)(void *ctx, int index, int count);
+
+typedef struct WorkerPool WorkerPool;
+
+typedef struct {
+  WorkerPool *pool;
+  int index;
+} PoolWorker;
+
+// Persistent render threads, reused across frames. The main thread takes
+// part in every job as index 0, so a pool without threads is a plain call.
+struct WorkerPool {
+  SDL_Thread **threads;
+  PoolWorker *workers;
+  int thread_count;
+  Barrier start;
+  Barrier done;
+  PoolJob job;
+  void *ctx;
+  int quit;
+};
+
+typedef struct VisibleSprite VisibleSprite;
+
+// Frame scratch for the sprites in view, grown as needed. Every thread has
+// its own, so whole frames can be rendered in parallel; the threads that
+// render free theirs before they exit.
+static _Thread_local struct {
+  VisibleSprite *items;
+  int capacity;
+} sprite_view;
+
+static void sprite_view_free(void) {
+  free(sprite_view.items);
+  sprite_view.items = NULL;
+  sprite_view.capacity = 0;
+}
+
+static int pool_worker_main(void *data) {
+  PoolWorker *w = data;
+  WorkerPool *pool = w->pool;
+
+  for (;;) {
+    barrier_wait(&pool->start);
+    if (pool->quit)
+      break;
+    pool->job(pool->ctx, w->index, pool->thread_count + 1);
+    barrier_wait(&pool->done);
+  }
+
+  sprite_view_free();
+  return 0;
+}
+
+static void pool_destroy(WorkerPool *pool) {
+  if (pool->thread_count > 0) {
+    SDL_LockMutex(pool->start.lock);
+    pool->quit = 1;
+    pool->start.count = pool->thread_count + 1;
+    SDL_UnlockMutex(pool->start.lock);
+
+    barrier_wait(&pool->start);
+    for (int i = 0; i < pool->thread_count; i++)
+      SDL_WaitThread(pool->threads[i], NULL);
+  }
+
+  if (pool->start.lock)
+    barrier_destroy(&pool->start);
+  if (pool->done.lock)
+    barrier_destroy(&pool->done);
+  free(pool->threads);
+  free(pool->workers);
+  memset(pool, 0, sizeof(*pool));
+}
+
+// thread_count is the total number of render threads including the main
+// thread; 0 picks one per CPU core. If the threads can't be started the
+// pool falls back to rendering on the main thread only.
+static void pool_init(WorkerPool *pool, int thread_count) {
+  memset(pool, 0, sizeof(*pool));
+
+  if (thread_count <= 0)
+    thread_count = SDL_GetCPUCount();
+  if (thread_count <= 1)
+    return;
+
+  int n = thread_count - 1;
+  pool->threads = calloc(n, sizeof(*pool->threads));
+  pool->workers = calloc(n, sizeof(*pool->workers));
+  if (!pool->threads || !pool->workers || !barrier_init(&pool->start, n + 1) ||
+      !barrier_init(&pool->done, n + 1)) {
+    fprintf(stderr, "Failed to set up render threads, using main thread\n");
+    pool_destroy(pool);
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].index = i + 1;
+    pool->threads[i] =
+        SDL_CreateThread(pool_worker_main, "render", &pool->workers[i]);
+    if (!pool->threads[i]) {
+      fprintf(stderr, "SDL_CreateThread Error: %s\n", SDL_GetError());
+      pool_destroy(pool);
+      return;
+    }
+    pool->thread_count++;
+  }
+}
+
+// Runs job(ctx, index, count) for every index in [0, count) and returns
+// once all of them have finished.
+static void pool_run(WorkerPool *pool, PoolJob job, void *ctx) {
+  if (pool->thread_count == 0) {
+    job(ctx, 0, 1);
+    return;
+  }
+
+  pool->job = job;
+  pool->ctx = ctx;
+  barrier_wait(&pool->start);
+  job(ctx, 0, pool->thread_count + 1);
+  barrier_wait(&pool->done);
+}
+
+static inline int split_range(int begin, int end, int index, int count) {
+  return begin + (int)((long long)(end - begin) * index / count);
+}
+
+// Circles of one radius moved together, each field in an array of its own.
+// Agents collide with the map but not with each other.
+typedef struct {
+  const struct Map *map;
+  float *pos_x;
+  float *pos_y;
+  const float *move_x; // displacement this step
+  const float *move_y;
+  int count;
+  float radius;
+} AgentBatch;
+
+// Moves a contiguous range of the agents, at least AGENT_BATCH of them per
+// thread.
+static void agent_batch_job(void *ctx, int index, int count) {
+  const AgentBatch *batch = ctx;
+  int used = mini(count, (batch->count + AGENT_BATCH - 1) / AGENT_BATCH);
+  if (index >= used)
+    return;
+
+  int begin = split_range(0, batch->count, index, used);
+  int end = split_range(0, batch->count, index + 1, used);
+  for (int i = begin; i < end; i++)
+    move_circle(batch->map, &batch->pos_x[i], &batch->pos_y[i],
+                batch->move_x[i], batch->move_y[i], batch->radius);
+}
+
+static void move_agents(WorkerPool *pool, AgentBatch *batch) {
+  if (batch->count <= AGENT_BATCH)
+    agent_batch_job(batch, 0, 1);
+  else
+    pool_run(pool, agent_batch_job, batch);
+}
+
+typedef struct RayCache RayCache;
+
+// The wall pass casts wall_columns rays across the frame, each one drawn
+// over fb.width / wall_columns pixels, and leaves the distance to the wall
+// in every pixel column in depth for the sprite pass.
+typedef struct {
+  const float *camera_lut;
+  const float *row_lut;
+  float *depth; // FLT_MAX where a column sees the sky
+  Framebuffer fb;
+  int wall_columns;
+  const Camera *camera;
+  const struct Map *map;
+  RayCache *rays; // NULL to cast every wall ray
+  const VisibleSprite *sprites; // far to near
+  int sprite_count;
+} RenderJob;
+
+// One floor row and its mirrored ceiling row. Pixel x samples the world at
+// (floor_x + x * step_x, floor_y + x * step_y); texel_scale is the world
+// distance between neighbouring pixels and drives mip selection. The whole
+// row is the same distance from the camera plane, so it shares one light.
+typedef struct {
+  const struct Map *map;
+  uint32_t *floor_row;
+  uint32_t *ceil_row;
+  float floor_x, floor_y;
+  float step_x, step_y;
+  float texel_scale;
+  Light light;
+  uint32_t ground; // GROUND_COLOR in this row's light
+} FloorRow;
+
+// A run of pixels that all land in map cell (map_x, map_y), with the mips
+// of the cell's floor and ceiling tiles. NULL mips draw ground and sky.
+typedef struct {
+  int map_x, map_y;
+  const TileMip *floor_mip;
+  const TileMip *ceil_mip;
+} FloorSpan;
+
+typedef void (*FloorKernel)(const FloorRow *row, const FloorSpan *span,
+                            int x0, int x1);
+
+static inline const TileMip *floor_mip(const FloorRow *row, const Tile *t) {
+  return t ? &t->mips[mip_level(t, row->texel_scale * t->width)] : NULL;
+}
+
+// Every kernel takes the width and height of both mips as size, so the
+// specializations below get the shifts and masks as constants, or 0 to
+// read them from the mips.
+#define FLOOR_INLINE static inline __attribute__((always_inline))
+
+// Offset of a texel in a power of two wide mip
+FLOOR_INLINE int texel_index(float frac_x, float frac_y, const TileMip *m,
+                             int size) {
+  int width = size ? size : m->width, height = size ? size : m->height;
+  int tex_x = (int)(frac_x * width) & (width - 1);
+  int tex_y = (int)(frac_y * height) & (height - 1);
+  return (tex_y << __builtin_ctz(width)) + tex_x;
+}
+
+// Reference implementation, every SIMD kernel must match it bit for bit.
+FLOOR_INLINE void floor_span_scalar(const FloorRow *row, const FloorSpan *span,
+                                    int x0, int x1, int size) {
+  const TileMip *fm = span->floor_mip, *cm = span->ceil_mip;
+
+  for (int x = x0; x < x1; x++) {
+    float frac_x = row->floor_x + (float)x * row->step_x - span->map_x;
+    float frac_y = row->floor_y + (float)x * row->step_y - span->map_y;
+
+    if (fm)
+      row->floor_row[x] =
+          0xFF000000u |
+          shade(fm->pixels[texel_index(frac_x, frac_y, fm, size)], row->light);
+    else
+      row->floor_row[x] = row->ground;
+
+    if (cm)
+      row->ceil_row[x] =
+          0xFF000000u |
+          shade(cm->ceiling[texel_index(frac_x, frac_y, cm, size)], row->light);
+    else
+      row->ceil_row[x] = SKY_COLOR;
+  }
+}
+
+// The SIMD kernels only run on spans with both a floor and a ceiling and
+// leave the last few pixels to the scalar kernel.
+#if HAVE_X86_SIMD
+__attribute__((target("avx2"))) FLOOR_INLINE __m256i
+texel_index_avx2(__m256 frac_x, __m256 frac_y, const TileMip *m, int size) {
+  int width = size ? size : m->width, height = size ? size : m->height;
+  __m256i tex_x = _mm256_and_si256(
+      _mm256_cvttps_epi32(_mm256_mul_ps(frac_x, _mm256_set1_ps((float)width))),
+      _mm256_set1_epi32(width - 1));
+  __m256i tex_y = _mm256_and_si256(
+      _mm256_cvttps_epi32(_mm256_mul_ps(frac_y, _mm256_set1_ps((float)height))),
+      _mm256_set1_epi32(height - 1));
+  return _mm256_add_epi32(
+      _mm256_sll_epi32(tex_y, _mm_cvtsi32_si128(__builtin_ctz(width))), tex_x);
+}
+
+// shade() on 16 bit lanes, scale is broadcast to all of them
+__attribute__((target("avx2"))) static inline __m256i
+shade_avx2(__m256i color, __m256i scale, __m256i fog) {
+  const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+  __m256i rb = _mm256_srli_epi16(
+      _mm256_mullo_epi16(_mm256_and_si256(color, mask), scale), 8);
+  __m256i ag = _mm256_srli_epi16(
+      _mm256_mullo_epi16(
+          _mm256_and_si256(_mm256_srli_epi32(color, 8), mask), scale),
+      8);
+  __m256i g = _mm256_and_si256(_mm256_slli_epi32(ag, 8),
+                               _mm256_set1_epi32(0x0000FF00));
+  return _mm256_add_epi32(_mm256_or_si256(rb, g), fog);
+}
+
+__attribute__((target("avx2"))) FLOOR_INLINE void
+floor_span_avx2(const FloorRow *row, const FloorSpan *span, int x0, int x1,
+                int size) {
+  const TileMip *fm = span->floor_mip, *cm = span->ceil_mip;
+  const __m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256 base_x = _mm256_set1_ps(row->floor_x);
+  const __m256 base_y = _mm256_set1_ps(row->floor_y);
+  const __m256 step_x = _mm256_set1_ps(row->step_x);
+  const __m256 step_y = _mm256_set1_ps(row->step_y);
+  const __m256 cell_x = _mm256_set1_ps((float)span->map_x);
+  const __m256 cell_y = _mm256_set1_ps((float)span->map_y);
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+  const __m256i scale = _mm256_set1_epi16((short)row->light.scale);
+  const __m256i fog = _mm256_set1_epi32((int)row->light.fog);
+
+  int x = x0;
+  for (; x + 8 <= x1 && fm && cm; x += 8) {
+    __m256 xs = _mm256_add_ps(_mm256_set1_ps((float)x), lane);
+    __m256 frac_x = _mm256_sub_ps(
+        _mm256_add_ps(base_x, _mm256_mul_ps(xs, step_x)), cell_x);
+    __m256 frac_y = _mm256_sub_ps(
+        _mm256_add_ps(base_y, _mm256_mul_ps(xs, step_y)), cell_y);
+
+    __m256i floor_color = _mm256_i32gather_epi32(
+        (const int *)fm->pixels, texel_index_avx2(frac_x, frac_y, fm, size), 4);
+    _mm256_storeu_si256(
+        (__m256i *)(row->floor_row + x),
+        _mm256_or_si256(shade_avx2(floor_color, scale, fog), alpha));
+
+    __m256i ceil_color = _mm256_i32gather_epi32(
+        (const int *)cm->ceiling, texel_index_avx2(frac_x, frac_y, cm, size),
+        4);
+    _mm256_storeu_si256(
+        (__m256i *)(row->ceil_row + x),
+        _mm256_or_si256(shade_avx2(ceil_color, scale, fog), alpha));
+  }
+
+  floor_span_scalar(row, span, x, x1, size);
+}
+
+// SSE has no gather, so the four texels are fetched with scalar loads and
+// stored as one vector.
+__attribute__((target("sse4.1"))) FLOOR_INLINE __m128i
+texel_index_sse41(__m128 frac_x, __m128 frac_y, const TileMip *m, int size) {
+  int width = size ? size : m->width, height = size ? size : m->height;
+  __m128i tex_x = _mm_and_si128(
+      _mm_cvttps_epi32(_mm_mul_ps(frac_x, _mm_set1_ps((float)width))),
+      _mm_set1_epi32(width - 1));
+  __m128i tex_y = _mm_and_si128(
+      _mm_cvttps_epi32(_mm_mul_ps(frac_y, _mm_set1_ps((float)height))),
+      _mm_set1_epi32(height - 1));
+  return _mm_add_epi32(
+      _mm_sll_epi32(tex_y, _mm_cvtsi32_si128(__builtin_ctz(width))), tex_x);
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i
+shade_sse41(__m128i color, __m128i scale, __m128i fog) {
+  const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+  __m128i rb =
+      _mm_srli_epi16(_mm_mullo_epi16(_mm_and_si128(color, mask), scale), 8);
+  __m128i ag = _mm_srli_epi16(
+      _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi32(color, 8), mask), scale), 8);
+  __m128i g =
+      _mm_and_si128(_mm_slli_epi32(ag, 8), _mm_set1_epi32(0x0000FF00));
+  return _mm_add_epi32(_mm_or_si128(rb, g), fog);
+}
+
+__attribute__((target("sse4.1"))) FLOOR_INLINE void
+floor_span_sse41(const FloorRow *row, const FloorSpan *span, int x0, int x1,
+                 int size) {
+  const TileMip *fm = span->floor_mip, *cm = span->ceil_mip;
+  const __m128 lane = _mm_setr_ps(0, 1, 2, 3);
+  const __m128 base_x = _mm_set1_ps(row->floor_x);
+  const __m128 base_y = _mm_set1_ps(row->floor_y);
+  const __m128 step_x = _mm_set1_ps(row->step_x);
+  const __m128 step_y = _mm_set1_ps(row->step_y);
+  const __m128 cell_x = _mm_set1_ps((float)span->map_x);
+  const __m128 cell_y = _mm_set1_ps((float)span->map_y);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+  const __m128i scale = _mm_set1_epi16((short)row->light.scale);
+  const __m128i fog = _mm_set1_epi32((int)row->light.fog);
+
+  int x = x0;
+  for (; x + 4 <= x1 && fm && cm; x += 4) {
+    __m128 xs = _mm_add_ps(_mm_set1_ps((float)x), lane);
+    __m128 frac_x =
+        _mm_sub_ps(_mm_add_ps(base_x, _mm_mul_ps(xs, step_x)), cell_x);
+    __m128 frac_y =
+        _mm_sub_ps(_mm_add_ps(base_y, _mm_mul_ps(xs, step_y)), cell_y);
+
+    int fi[4], ci[4];
+    _mm_storeu_si128((__m128i *)fi,
+                     texel_index_sse41(frac_x, frac_y, fm, size));
+    _mm_storeu_si128((__m128i *)ci,
+                     texel_index_sse41(frac_x, frac_y, cm, size));
+
+    const uint32_t *fp = fm->pixels;
+    const uint32_t *cp = cm->ceiling;
+    __m128i floor_color = _mm_setr_epi32(fp[fi[0]], fp[fi[1]], fp[fi[2]],
+                                         fp[fi[3]]);
+    __m128i ceil_color = _mm_setr_epi32(cp[ci[0]], cp[ci[1]], cp[ci[2]],
+                                        cp[ci[3]]);
+    _mm_storeu_si128((__m128i *)(row->floor_row + x),
+                     _mm_or_si128(shade_sse41(floor_color, scale, fog), alpha));
+    _mm_storeu_si128((__m128i *)(row->ceil_row + x),
+                     _mm_or_si128(shade_sse41(ceil_color, scale, fog), alpha));
+  }
+
+  floor_span_scalar(row, span, x, x1, size);
+}
+#endif
+
+#if HAVE_NEON
+FLOOR_INLINE int32x4_t texel_index_neon(float32x4_t frac_x,
+                                        float32x4_t frac_y, const TileMip *m,
+                                        int size) {
+  int width = size ? size : m->width, height = size ? size : m->height;
+  int32x4_t tex_x =
+      vandq_s32(vcvtq_s32_f32(vmulq_f32(frac_x, vdupq_n_f32((float)width))),
+                vdupq_n_s32(width - 1));
+  int32x4_t tex_y =
+      vandq_s32(vcvtq_s32_f32(vmulq_f32(frac_y, vdupq_n_f32((float)height))),
+                vdupq_n_s32(height - 1));
+  return vaddq_s32(vshlq_s32(tex_y, vdupq_n_s32(__builtin_ctz(width))), tex_x);
+}
+
+static inline uint32x4_t shade_neon(uint32x4_t color, uint16x8_t scale,
+                                    uint32x4_t fog) {
+  const uint32x4_t mask = vdupq_n_u32(0x00FF00FFu);
+  uint16x8_t rb = vshrq_n_u16(
+      vmulq_u16(vreinterpretq_u16_u32(vandq_u32(color, mask)), scale), 8);
+  uint16x8_t ag = vshrq_n_u16(
+      vmulq_u16(vreinterpretq_u16_u32(vandq_u32(vshrq_n_u32(color, 8), mask)),
+                scale),
+      8);
+  uint32x4_t g = vandq_u32(vshlq_n_u32(vreinterpretq_u32_u16(ag), 8),
+                           vdupq_n_u32(0x0000FF00u));
+  return vaddq_u32(vorrq_u32(vreinterpretq_u32_u16(rb), g), fog);
+}
+
+FLOOR_INLINE void floor_span_neon(const FloorRow *row, const FloorSpan *span,
+                                  int x0, int x1, int size) {
+  const TileMip *fm = span->floor_mip, *cm = span->ceil_mip;
+  const float lane_init[4] = {0, 1, 2, 3};
+  const float32x4_t lane = vld1q_f32(lane_init);
+  const float32x4_t base_x = vdupq_n_f32(row->floor_x);
+  const float32x4_t base_y = vdupq_n_f32(row->floor_y);
+  const float32x4_t step_x = vdupq_n_f32(row->step_x);
+  const float32x4_t step_y = vdupq_n_f32(row->step_y);
+  const float32x4_t cell_x = vdupq_n_f32((float)span->map_x);
+  const float32x4_t cell_y = vdupq_n_f32((float)span->map_y);
+  const uint32x4_t alpha = vdupq_n_u32(0xFF000000u);
+  const uint16x8_t scale = vdupq_n_u16((uint16_t)row->light.scale);
+  const uint32x4_t fog = vdupq_n_u32(row->light.fog);
+
+  int x = x0;
+  for (; x + 4 <= x1 && fm && cm; x += 4) {
+    float32x4_t xs = vaddq_f32(vdupq_n_f32((float)x), lane);
+    float32x4_t frac_x =
+        vsubq_f32(vaddq_f32(base_x, vmulq_f32(xs, step_x)), cell_x);
+    float32x4_t frac_y =
+        vsubq_f32(vaddq_f32(base_y, vmulq_f32(xs, step_y)), cell_y);
+
+    int32_t fi[4], ci[4];
+    vst1q_s32(fi, texel_index_neon(frac_x, frac_y, fm, size));
+    vst1q_s32(ci, texel_index_neon(frac_x, frac_y, cm, size));
+
+    const uint32_t *fp = fm->pixels;
+    const uint32_t *cp = cm->ceiling;
+    uint32_t floor_texels[4] = {fp[fi[0]], fp[fi[1]], fp[fi[2]], fp[fi[3]]};
+    uint32_t ceil_texels[4] = {cp[ci[0]], cp[ci[1]], cp[ci[2]], cp[ci[3]]};
+    vst1q_u32(row->floor_row + x,
+              vorrq_u32(shade_neon(vld1q_u32(floor_texels), scale, fog), alpha));
+    vst1q_u32(row->ceil_row + x,
+              vorrq_u32(shade_neon(vld1q_u32(ceil_texels), scale, fog), alpha));
+  }
+
+  floor_span_scalar(row, span, x, x1, size);
+}
+#endif
+
+// One FloorKernel per FLOOR_KERNEL_* for each instruction set, those for the
+// sizes calling the body with a constant size.
+#define FLOOR_KERNEL(body, target, size)                                       \
+  target static void body##_##size(const FloorRow *row, const FloorSpan *span, \
+                                   int x0, int x1) {                           \
+    body(row, span, x0, x1, size);                                             \
+  }
+#define FLOOR_KERNELS(body, target)                                            \
+  FLOOR_KERNEL(body, target, 0)                                                \
+  FLOOR_KERNEL(body, target, 64)                                               \
+  FLOOR_KERNEL(body, target, 128)                                              \
+  FLOOR_KERNEL(body, target, 256)                                              \
+  static const FloorKernel body##_kernels[FLOOR_KERNEL_COUNT] = {              \
+      body##_0, body##_64, body##_128, body##_256};
+
+FLOOR_KERNELS(floor_span_scalar, )
+#if HAVE_X86_SIMD
+FLOOR_KERNELS(floor_span_avx2, __attribute__((target("avx2"))))
+FLOOR_KERNELS(floor_span_sse41, __attribute__((target("sse4.1"))))
+#endif
+#if HAVE_NEON
+FLOOR_KERNELS(floor_span_neon, )
+#endif
+
+// The floor kernels of each instruction set, widest first. supported is
+// NULL for the scalar ones, which run everywhere.
+static const struct {
+  const char *name;
+  const FloorKernel *kernels;
+  SDL_bool (*supported)(void);
+} floor_isas[] = {
+#if HAVE_X86_SIMD
+    {"avx2", floor_span_avx2_kernels, SDL_HasAVX2},
+    {"sse4.1", floor_span_sse41_kernels, SDL_HasSSE41},
+#endif
+#if HAVE_NEON
+    {"neon", floor_span_neon_kernels, SDL_HasNEON},
+#endif
+    {"scalar", floor_span_scalar_kernels, NULL},
+};
+#define FLOOR_ISA_COUNT ((int)(sizeof(floor_isas) / sizeof(floor_isas[0])))
+
+static const FloorKernel *floor_kernels = floor_span_scalar_kernels;
+
+static int floor_isa_supported(int isa) {
+  return !floor_isas[isa].supported || floor_isas[isa].supported();
+}
+
+// Picks the widest floor kernels the running CPU supports.
+static const char *select_floor_kernel(void) {
+  int isa = 0;
+  while (!floor_isa_supported(isa))
+    isa++;
+  floor_kernels = floor_isas[isa].kernels;
+  return floor_isas[isa].name;
+}
+
+// Distance from the camera to the floor under each row of the lower screen
+// half, indexed by y - height / 2.
+static float *generate_row_lut(int height) {
+  float *lut = (float *)malloc((height - height / 2) * sizeof(float));
+  if (!lut)
+    return NULL;
+
+  float camera_z = 0.5f * height;
+  for (int y = height / 2; y < height; y++)
+    lut[y - height / 2] = camera_z / (float)(y - height / 2.0f);
+
+  return lut;
+}
+
+static inline int floor_cell(float origin, float step, int x) {
+  return (int)floorf(origin + (float)x * step);
+}
+
+// Pixels until pos leaves the cell along one axis, a close estimate.
+static inline float cell_pixels(float pos, int cell, float step) {
+  if (step > 0.0f)
+    return ((float)cell + 1.0f - pos) / step;
+  if (step < 0.0f)
+    return ((float)cell - pos) / step;
+  return (float)INT_MAX;
+}
+
+// End of the span starting at x0. Pixel cells only move one way along a
+// row, so the estimate is fixed up by checking the pixels at its border.
+static int floor_span_end(const FloorRow *row, const FloorSpan *span,
+                          float floor_x, float floor_y, int x0, int x1) {
+  // a cell or more per pixel, spans of more than one are rare
+  if (fabsf(row->step_x) >= 1.0f || fabsf(row->step_y) >= 1.0f)
+    return x0 + 1;
+
+  float n = fminf(cell_pixels(floor_x, span->map_x, row->step_x),
+                  cell_pixels(floor_y, span->map_y, row->step_y));
+  n = fminf(fmaxf(ceilf(n), 1.0f), (float)(x1 - x0));
+  int end = x0 + mini(maxi((int)n, 1), x1 - x0);
+
+  while (end > x0 + 1 &&
+         (floor_cell(row->floor_x, row->step_x, end - 1) != span->map_x ||
+          floor_cell(row->floor_y, row->step_y, end - 1) != span->map_y))
+    end--;
+  while (end < x1 &&
+         floor_cell(row->floor_x, row->step_x, end) == span->map_x &&
+         floor_cell(row->floor_y, row->step_y, end) == span->map_y)
+    end++;
+  return end;
+}
+
+// Walks the row one map cell at a time, so the floor and ceiling tiles and
+// their mips are looked up once per cell the row crosses instead of once
+// per pixel.
+static void render_floor_row(const FloorRow *row, int width) {
+  const Tile *last_floor = NULL, *last_ceiling = NULL;
+  FloorSpan span = {0};
+  FloorKernel kernel = floor_kernels[FLOOR_KERNEL_ANY];
+
+  for (int x = 0; x < width;) {
+    float floor_x = row->floor_x + (float)x * row->step_x;
+    float floor_y = row->floor_y + (float)x * row->step_y;
+    span.map_x = (int)floorf(floor_x);
+    span.map_y = (int)floorf(floor_y);
+    int end = floor_span_end(row, &span, floor_x, floor_y, x, width);
+
+    const Tile *floor_tile = get_floor_tile(row->map, span.map_x, span.map_y);
+    // walls always hide whatever is drawn above them
+    const Tile *ceil_tile =
+        map_type(row->map, span.map_x, span.map_y) != TILE_TYPE_WALL
+            ? get_ceiling_tile(row->map, span.map_x, span.map_y)
+            : NULL;
+    if (!floor_tile && !ceil_tile) {
+      for (; x < end; x++) {
+        row->floor_row[x] = row->ground;
+        row->ceil_row[x] = SKY_COLOR;
+      }
+      continue;
+    }
+    if (floor_tile != last_floor || ceil_tile != last_ceiling) {
+      span.floor_mip = floor_mip(row, floor_tile);
+      span.ceil_mip = floor_mip(row, ceil_tile);
+      last_floor = floor_tile;
+      last_ceiling = ceil_tile;
+      // the size specializations need both mips the same size
+      const TileMip *fm = span.floor_mip, *cm = span.ceil_mip;
+      kernel = floor_kernels[fm && cm && fm->kernel == cm->kernel
+                                 ? fm->kernel
+                                 : FLOOR_KERNEL_ANY];
+    }
+
+    kernel(row, &span, x, end);
+    x = end;
+  }
+}
+
+// Floor rows [y0, y1) of the lower screen half, mirrored for the ceiling.
+static void render_floor(const RenderJob *job, int y0, int y1) {
+  const Framebuffer *fb = &job->fb;
+  const Camera *camera = job->camera;
+  FloorRow row = {.map = job->map};
+
+  float ray_dir_x0 = camera->dir_x - camera->plane_x;
+  float ray_dir_y0 = camera->dir_y - camera->plane_y;
+  float ray_dir_x1 = camera->dir_x + camera->plane_x;
+  float ray_dir_y1 = camera->dir_y + camera->plane_y;
+  float ray_span_x = ray_dir_x1 - ray_dir_x0;
+  float ray_span_y = ray_dir_y1 - ray_dir_y0;
+
+  for (int y = y0; y < y1; y++) {
+    float row_dist = job->row_lut[y - fb->height / 2];
+
+    row.step_x = row_dist * ray_span_x / fb->width;
+    row.step_y = row_dist * ray_span_y / fb->width;
+    row.texel_scale = hypotf(row.step_x, row.step_y);
+    row.light = light_at(row_dist);
+    row.ground = 0xFF000000u | shade(GROUND_COLOR, row.light);
+
+    row.floor_x = camera->pos_x + ray_dir_x0 * row_dist;
+    row.floor_y = camera->pos_y + ray_dir_y0 * row_dist;
+
+    row.floor_row = (uint32_t *)(fb->pixels + (size_t)y * fb->pitch);
+    row.ceil_row =
+        (uint32_t *)(fb->pixels + (size_t)(fb->height - y - 1) * fb->pitch);
+
+    render_floor_row(&row, fb->width);
+  }
+}
+
+// Distance along the ray to the n-th grid line of one axis. Jumps and
+// single steps share it so that they compare bit-identical values.
+static inline float dda_side(float side0, float delta, int n) {
+  return side0 + (float)n * delta;
+}
+
+// First step count in [n, limit] whose grid line is not before t, i.e. the
+// number of steps the DDA takes on this axis before reaching t.
+static inline int dda_steps_before(float side0, float delta, int n, int limit,
+                                   float t) {
+  int k = (int)clampf(ceilf((t - side0) / delta), (float)n, (float)limit);
+  while (k < limit && dda_side(side0, delta, k) < t)
+    k++;
+  while (k > n && dda_side(side0, delta, k - 1) >= t)
+    k--;
+  return k;
+}
+
+typedef struct {
+  Tile *tile; // NULL if the ray leaves the map or runs out of steps
+  int map_x;
+  int map_y;
+  int side; // 0 for an x-side, 1 for a y-side
+  float dist; // perpendicular distance to the hit
+  float tex_shift; // share the texture is slid by, for doors
+  int through_door; // passed a door cell without hitting its panel
+} RayHit;
+
+// Where a ray starts and how it crosses the grid lines.
+typedef struct {
+  float pos_x, pos_y;
+  float dir_x, dir_y;
+  int start_x, start_y;
+  int step_x, step_y;
+  // length of ray from one x or y-side to next x or y-side
+  float delta_x, delta_y;
+  // length of ray from the start position to the first x or y-side
+  float side_x, side_y;
+} RaySetup;
+
+// -ffast-math rounds this differently depending on where it is inlined, so
+// it is kept out of line with strict math for cast_ray() and the packet
+// kernels to start from bit-identical sides.
+#if defined(__GNUC__) && !defined(__clang__)
+__attribute__((optimize("no-fast-math")))
+#endif
+static RaySetup ray_setup(float ray_pos_x, float ray_pos_y, float ray_dir_x,
+                          float ray_dir_y) {
+  RaySetup s;
+  s.pos_x = ray_pos_x, s.pos_y = ray_pos_y;
+  s.dir_x = ray_dir_x, s.dir_y = ray_dir_y;
+  s.start_x = (int)ray_pos_x;
+  s.start_y = (int)ray_pos_y;
+  s.delta_x = inv_abs(ray_dir_x);
+  s.delta_y = inv_abs(ray_dir_y);
+  s.step_x = sgnf(ray_dir_x);
+  s.step_y = sgnf(ray_dir_y);
+  s.side_x = (ray_dir_x < 0) ? (ray_pos_x - s.start_x) * s.delta_x
+                             : (s.start_x + 1.0f - ray_pos_x) * s.delta_x;
+  s.side_y = (ray_dir_y < 0) ? (ray_pos_y - s.start_y) * s.delta_y
+                             : (s.start_y + 1.0f - ray_pos_y) * s.delta_y;
+  return s;
+}
+
+static inline int is_wall(const struct Map *map, int x, int y) {
+  return is_solid(map, x, y) && map_type(map, x, y) == TILE_TYPE_WALL;
+}
+
+// Tests the panel of the door the ray entered at entry, its nx-th x and
+// ny-th y step. The panel runs through the middle of the cell, between the
+// walls on either side, and the part slid into the wall lets rays through.
+static int hit_door(const struct Map *map, const RaySetup *s, int map_x,
+                    int map_y, int nx, int ny, float entry, RayHit *hit) {
+  float exit = fminf(dda_side(s->side_x, s->delta_x, nx),
+                     dda_side(s->side_y, s->delta_y, ny));
+  int side = is_wall(map, map_x - 1, map_y) || is_wall(map, map_x + 1, map_y);
+  float t, u;
+  if (side) {
+    t = dda_side(s->side_y, s->delta_y, ny) - 0.5f * s->delta_y;
+    u = s->pos_x + t * s->dir_x - map_x;
+  } else {
+    t = dda_side(s->side_x, s->delta_x, nx) - 0.5f * s->delta_x;
+    u = s->pos_y + t * s->dir_y - map_y;
+  }
+  const Door *d = map_door(map, map_x, map_y);
+  float open = d ? d->open : 0.0f;
+  if (t < entry || t >= exit || u < open)
+    return 0;
+  *hit = (RayHit){get_tile(map, map_x, map_y), map_x, map_y, side, t, open, 0};
+  return 1;
+}
+
+static RayHit cast_ray(const struct Map *map, float ray_pos_x, float ray_pos_y,
+                       float ray_dir_x, float ray_dir_y) {
+  RaySetup s = ray_setup(ray_pos_x, ray_pos_y, ray_dir_x, ray_dir_y);
+  RayHit hit = {NULL, s.start_x, s.start_y, 0, 0.0f, 0.0f, 0};
+
+  int nx = 0, ny = 0; // x and y steps taken so far
+  int side = 0;
+  int through_door = 0;
+  while (nx + ny < MAP_MAX_STEPS) {
+    int map_x = s.start_x + nx * s.step_x;
+    int map_y = s.start_y + ny * s.step_y;
+
+#if EMPTY_SPACE_SKIPPING
+    // Every cell within Chebyshev distance r of this one is empty, and the
+    // next r steps can't get further than that: take them all at once.
+    int r = map_wall_distance(map, map_x, map_y) - 1;
+    if (r > 0) {
+      float t = fminf(dda_side(s.side_x, s.delta_x, nx + r),
+                      dda_side(s.side_y, s.delta_y, ny + r));
+      nx = dda_steps_before(s.side_x, s.delta_x, nx, nx + r, t);
+      ny = dda_steps_before(s.side_y, s.delta_y, ny, ny + r, t);
+      continue;
+    }
+    // The map is convex, a ray that left it never comes back
+    if ((map_x < 0 && s.step_x <= 0) ||
+        (map_x >= (int)map->width && s.step_x >= 0) ||
+        (map_y < 0 && s.step_y <= 0) ||
+        (map_y >= (int)map->height && s.step_y >= 0))
+      break;
+#endif
+
+    // the side crossed is also the perpendicular distance to the next cell
+    float dist_x = dda_side(s.side_x, s.delta_x, nx);
+    float dist_y = dda_side(s.side_y, s.delta_y, ny);
+    float dist;
+    if (dist_x < dist_y) {
+      nx++;
+      map_x += s.step_x;
+      side = 0;
+      dist = dist_x;
+    } else {
+      ny++;
+      map_y += s.step_y;
+      side = 1;
+      dist = dist_y;
+    }
+
+    // by type, since open doors aren't solid but still have a panel
+    TileType type = map_type(map, map_x, map_y);
+    if (type == TILE_TYPE_WALL) {
+      hit.tile = get_tile(map, map_x, map_y);
+      hit.map_x = map_x;
+      hit.map_y = map_y;
+      hit.side = side;
+      hit.dist = dist;
+      break;
+    }
+    if (type == TILE_TYPE_DOOR) {
+      if (hit_door(map, &s, map_x, map_y, nx, ny, dist, &hit))
+        break;
+      through_door = 1;
+    }
+  }
+  hit.through_door = through_door;
+  return hit;
+}
+
+// Rays of neighbouring columns nearly always cross the same cells, so the
+// ray kernels trace them in packets, stepping all rays with masks instead of
+// one branchy loop per ray. Every lane starts from the same ray_setup(),
+// takes exactly the steps cast_ray() would and stops on its own, so the
+// hits are bit-identical.
+#define RAY_PACKET 8
+#define RAY_PACKET_MIN 3
+
+typedef void (*RayKernel)(const struct Map *map, float ray_pos_x,
+                          float ray_pos_y, const float *ray_dir_x,
+                          const float *ray_dir_y, RayHit *hits);
+
+static void cast_rays_scalar(const struct Map *map, float ray_pos_x,
+                             float ray_pos_y, const float *ray_dir_x,
+                             const float *ray_dir_y, RayHit *hits) {
+  for (int i = 0; i < RAY_PACKET; i++)
+    hits[i] = cast_ray(map, ray_pos_x, ray_pos_y, ray_dir_x[i], ray_dir_y[i]);
+}
+
+#if HAVE_X86_SIMD
+// dda_side() per lane. Where the target has FMA the compiler contracts
+// dda_side() into one, so this fuses explicitly to round the same.
+__attribute__((target("avx2"))) static inline __m256
+dda_side_avx2(__m256 side0, __m256 delta, __m256i n) {
+#ifdef __FMA__
+  return _mm256_fmadd_ps(_mm256_cvtepi32_ps(n), delta, side0);
+#else
+  return _mm256_add_ps(side0, _mm256_mul_ps(_mm256_cvtepi32_ps(n), delta));
+#endif
+}
+
+// dda_steps_before() per lane; lanes with limit == n keep n.
+__attribute__((target("avx2"))) static inline __m256i
+dda_steps_before_avx2(__m256 side0, __m256 delta, __m256i n, __m256i limit,
+                      __m256 t) {
+  // max_ps returns its second operand for NaN, leaving idle lanes at n
+  __m256 k0 = _mm256_ceil_ps(_mm256_div_ps(_mm256_sub_ps(t, side0), delta));
+  k0 = _mm256_min_ps(_mm256_max_ps(k0, _mm256_cvtepi32_ps(n)),
+                     _mm256_cvtepi32_ps(limit));
+  __m256i k = _mm256_cvttps_epi32(k0);
+  for (;;) {
+    __m256i more = _mm256_and_si256(
+        _mm256_cmpgt_epi32(limit, k),
+        _mm256_castps_si256(
+            _mm256_cmp_ps(dda_side_avx2(side0, delta, k), t, _CMP_LT_OQ)));
+    if (_mm256_testz_si256(more, more))
+      break;
+    k = _mm256_sub_epi32(k, more);
+  }
+  for (;;) {
+    __m256i prev = _mm256_sub_epi32(k, _mm256_set1_epi32(1));
+    __m256i less = _mm256_and_si256(
+        _mm256_cmpgt_epi32(k, n),
+        _mm256_castps_si256(
+            _mm256_cmp_ps(dda_side_avx2(side0, delta, prev), t, _CMP_GE_OQ)));
+    if (_mm256_testz_si256(less, less))
+      break;
+    k = _mm256_add_epi32(k, less);
+  }
+  return k;
+}
+
+// Looks up the cells of the active lanes: their wall distance and whether
+// they are walls or doors. The chunked map can't be gathered from directly,
+// so this is the one part done lane by lane.
+__attribute__((target("avx2"))) static inline void
+ray_cells_avx2(const struct Map *map, __m256i map_x, __m256i map_y,
+               __m256i active, __m256i *distance, __m256i *wall,
+               __m256i *door) {
+  int xs[RAY_PACKET], ys[RAY_PACKET];
+  int ds[RAY_PACKET] = {0}, ws[RAY_PACKET] = {0}, dr[RAY_PACKET] = {0};
+  _mm256_storeu_si256((__m256i *)xs, map_x);
+  _mm256_storeu_si256((__m256i *)ys, map_y);
+  for (int m = _mm256_movemask_ps(_mm256_castsi256_ps(active)); m;
+       m &= m - 1) {
+    int i = __builtin_ctz(m);
+#if EMPTY_SPACE_SKIPPING
+    ds[i] = map_wall_distance(map, xs[i], ys[i]);
+#endif
+    TileType type = map_type(map, xs[i], ys[i]);
+    ws[i] = -(type == TILE_TYPE_WALL);
+    dr[i] = -(type == TILE_TYPE_DOOR);
+  }
+  *distance = _mm256_loadu_si256((const __m256i *)ds);
+  *wall = _mm256_loadu_si256((const __m256i *)ws);
+  *door = _mm256_loadu_si256((const __m256i *)dr);
+}
+
+__attribute__((target("avx2"))) static void
+cast_rays_avx2(const struct Map *map, float ray_pos_x, float ray_pos_y,
+               const float *ray_dir_x, const float *ray_dir_y, RayHit *hits) {
+  RaySetup rays[RAY_PACKET];
+  int through_door[RAY_PACKET] = {0};
+  int start_x[RAY_PACKET], start_y[RAY_PACKET];
+  int step_x[RAY_PACKET], step_y[RAY_PACKET];
+  float delta_x[RAY_PACKET], delta_y[RAY_PACKET];
+  float side_x[RAY_PACKET], side_y[RAY_PACKET];
+  for (int i = 0; i < RAY_PACKET; i++) {
+    RaySetup s = ray_setup(ray_pos_x, ray_pos_y, ray_dir_x[i], ray_dir_y[i]);
+    rays[i] = s;
+    start_x[i] = s.start_x, start_y[i] = s.start_y;
+    step_x[i] = s.step_x, step_y[i] = s.step_y;
+    delta_x[i] = s.delta_x, delta_y[i] = s.delta_y;
+    side_x[i] = s.side_x, side_y[i] = s.side_y;
+    hits[i] = (RayHit){NULL, s.start_x, s.start_y, 0, 0.0f, 0.0f, 0};
+  }
+
+  const __m256i sx0 = _mm256_loadu_si256((const __m256i *)start_x);
+  const __m256i sy0 = _mm256_loadu_si256((const __m256i *)start_y);
+  const __m256i stx = _mm256_loadu_si256((const __m256i *)step_x);
+  const __m256i sty = _mm256_loadu_si256((const __m256i *)step_y);
+  const __m256 dx = _mm256_loadu_ps(delta_x), dy = _mm256_loadu_ps(delta_y);
+  const __m256 side0_x = _mm256_loadu_ps(side_x);
+  const __m256 side0_y = _mm256_loadu_ps(side_y);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i max_steps = _mm256_set1_epi32(MAP_MAX_STEPS);
+#if EMPTY_SPACE_SKIPPING
+  const __m256i width = _mm256_set1_epi32((int)map->width);
+  const __m256i height = _mm256_set1_epi32((int)map->height);
+  // lanes stepping towards -x / +x, etc.; a zero step counts as both
+  const __m256i away_lo_x = _mm256_cmpgt_epi32(one, stx);
+  const __m256i away_hi_x = _mm256_cmpgt_epi32(stx, _mm256_set1_epi32(-1));
+  const __m256i away_lo_y = _mm256_cmpgt_epi32(one, sty);
+  const __m256i away_hi_y = _mm256_cmpgt_epi32(sty, _mm256_set1_epi32(-1));
+#endif
+
+  __m256i nx = zero, ny = zero, side = zero;
+  __m256i active = _mm256_set1_epi32(-1);
+  __m256i distance, wall, door;
+  ray_cells_avx2(map, sx0, sy0, active, &distance, &wall, &door);
+
+  for (;;) {
+    active = _mm256_and_si256(
+        active, _mm256_cmpgt_epi32(max_steps, _mm256_add_epi32(nx, ny)));
+    if (_mm256_testz_si256(active, active))
+      break;
+    __m256i stepping = active;
+
+#if EMPTY_SPACE_SKIPPING
+    __m256i r = _mm256_sub_epi32(distance, one);
+    __m256i jump = _mm256_and_si256(active, _mm256_cmpgt_epi32(r, zero));
+    if (!_mm256_testz_si256(jump, jump)) {
+      r = _mm256_and_si256(r, jump);
+      __m256i limit_x = _mm256_add_epi32(nx, r);
+      __m256i limit_y = _mm256_add_epi32(ny, r);
+      __m256 t = _mm256_min_ps(dda_side_avx2(side0_x, dx, limit_x),
+                               dda_side_avx2(side0_y, dy, limit_y));
+      nx = dda_steps_before_avx2(side0_x, dx, nx, limit_x, t);
+      ny = dda_steps_before_avx2(side0_y, dy, ny, limit_y, t);
+      stepping = _mm256_andnot_si256(jump, stepping);
+    }
+
+    // the map is convex, a ray that left it never comes back
+    __m256i map_x = _mm256_add_epi32(sx0, _mm256_mullo_epi32(nx, stx));
+    __m256i map_y = _mm256_add_epi32(sy0, _mm256_mullo_epi32(ny, sty));
+    __m256i left = _mm256_or_si256(
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(zero, map_x), away_lo_x),
+            _mm256_andnot_si256(_mm256_cmpgt_epi32(width, map_x), away_hi_x)),
+        _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(zero, map_y), away_lo_y),
+            _mm256_andnot_si256(_mm256_cmpgt_epi32(height, map_y),
+                                away_hi_y)));
+    left = _mm256_and_si256(left, stepping);
+    active = _mm256_andnot_si256(left, active);
+    stepping = _mm256_andnot_si256(left, stepping);
+#endif
+
+    // branchless side selection: x-steps are the mask lanes, y-steps the rest
+    __m256 dist_x = dda_side_avx2(side0_x, dx, nx);
+    __m256 dist_y = dda_side_avx2(side0_y, dy, ny);
+    __m256 x_side = _mm256_cmp_ps(dist_x, dist_y, _CMP_LT_OQ);
+    __m256i step_x_side = _mm256_and_si256(stepping, _mm256_castps_si256(x_side));
+    __m256i step_y_side = _mm256_andnot_si256(step_x_side, stepping);
+    nx = _mm256_sub_epi32(nx, step_x_side);
+    ny = _mm256_sub_epi32(ny, step_y_side);
+    side = _mm256_blendv_epi8(side, _mm256_and_si256(step_y_side, one),
+                              stepping);
+
+    __m256i cell_x = _mm256_add_epi32(sx0, _mm256_mullo_epi32(nx, stx));
+    __m256i cell_y = _mm256_add_epi32(sy0, _mm256_mullo_epi32(ny, sty));
+    ray_cells_avx2(map, cell_x, cell_y, active, &distance, &wall, &door);
+
+    // doors are tested lane by lane, the lanes that miss keep stepping
+    __m256i hit = _mm256_and_si256(stepping, wall);
+    __m256i at_door = _mm256_and_si256(stepping, door);
+    __m256i found = _mm256_or_si256(hit, at_door);
+    if (!_mm256_testz_si256(found, found)) {
+      int xs[RAY_PACKET], ys[RAY_PACKET], sides[RAY_PACKET];
+      int nxs[RAY_PACKET], nys[RAY_PACKET], done[RAY_PACKET] = {0};
+      float dists[RAY_PACKET];
+      _mm256_storeu_ps(dists, _mm256_blendv_ps(dist_y, dist_x, x_side));
+      _mm256_storeu_si256((__m256i *)xs, cell_x);
+      _mm256_storeu_si256((__m256i *)ys, cell_y);
+      _mm256_storeu_si256((__m256i *)sides, side);
+      _mm256_storeu_si256((__m256i *)nxs, nx);
+      _mm256_storeu_si256((__m256i *)nys, ny);
+      for (int m = _mm256_movemask_ps(_mm256_castsi256_ps(hit)); m;
+           m &= m - 1) {
+        int i = __builtin_ctz(m);
+        hits[i] = (RayHit){get_tile(map, xs[i], ys[i]), xs[i], ys[i],
+                           sides[i], dists[i], 0.0f, 0};
+        done[i] = -1;
+      }
+      for (int m = _mm256_movemask_ps(_mm256_castsi256_ps(at_door)); m;
+           m &= m - 1) {
+        int i = __builtin_ctz(m);
+        done[i] = -hit_door(map, &rays[i], xs[i], ys[i], nxs[i], nys[i],
+                            dists[i], &hits[i]);
+        through_door[i] |= !done[i];
+      }
+      active = _mm256_andnot_si256(
+          _mm256_loadu_si256((const __m256i *)done), active);
+    }
+  }
+  for (int i = 0; i < RAY_PACKET; i++)
+    hits[i].through_door = through_door[i];
+}
+#endif
+
+static RayKernel ray_kernel = cast_rays_scalar;
+
+// The wall hits of the last frame, kept so that while the camera only turns
+// most rays can be reprojected instead of cast. A frame reads one buffer
+// and fills the other.
+struct RayCache {
+  RayHit *hits[2]; // by wall column, capacity columns each
+  int capacity;
+  int current; // buffer of the last frame
+  int columns; // and its wall columns, 0 if it has none
+  int width;
+  Camera camera;
+  unsigned revision; // of the map
+  int reuse; // set for the frame being rendered
+};
+
+static inline float column_camera_x(const RenderJob *job, int c) {
+  int x0 = split_range(0, job->fb.width, c, job->wall_columns);
+  int x1 = split_range(0, job->fb.width, c + 1, job->wall_columns);
+  return job->camera_lut[(x0 + x1 - 1) / 2];
+}
+
+// A camera that only turned sees every ray in between two of the last
+// frame's. If those hit the same face, close enough that no cell fits in
+// between, the ray hits it too: a cell it met first would have blocked one
+// of them. Only its distance is worked out again. Door panels are thinner
+// than a cell, so rays that passed a door are never reprojected.
+static int reproject_hit(const RenderJob *job, float ray_dir_x,
+                         float ray_dir_y, RayHit *hit) {
+  const RayCache *rc = job->rays;
+  const Camera *old = &rc->camera;
+  const RayHit *hits = rc->hits[rc->current];
+
+  // the ray's camera_x in the last frame, the columns around it
+  float forward = ray_dir_x * old->dir_x + ray_dir_y * old->dir_y;
+  float plane2 = old->plane_x * old->plane_x + old->plane_y * old->plane_y;
+  if (forward <= 0.0f)
+    return 0;
+  float camera_x = (ray_dir_x * old->plane_x + ray_dir_y * old->plane_y) /
+                   (plane2 * forward);
+  int columns = job->wall_columns;
+  if (columns < 2 || camera_x < column_camera_x(job, 0) ||
+      camera_x >= column_camera_x(job, columns - 1))
+    return 0; // newly exposed
+
+  // invert the camera LUT, then settle on the column at or below camera_x
+  int pixel = (int)((camera_x + 1.0f) * 0.5f * job->fb.width);
+  int lo = mini(maxi((int)((long long)pixel * columns / job->fb.width), 0),
+                columns - 2);
+  while (lo > 0 && column_camera_x(job, lo) > camera_x)
+    lo--;
+  while (lo < columns - 2 && column_camera_x(job, lo + 1) <= camera_x)
+    lo++;
+  int hi = lo + 1;
+  float lo_x = column_camera_x(job, lo), hi_x = column_camera_x(job, hi);
+
+  // the same face, or the faces of two walls side by side, which continue
+  // each other
+  const RayHit *a = &hits[lo], *b = &hits[hi];
+  int side = a->side;
+  if (!a->tile || !b->tile || b->side != side || a->through_door ||
+      b->through_door)
+    return 0;
+  if ((a->map_x != b->map_x || a->map_y != b->map_y) &&
+      (a->tile->type != TILE_TYPE_WALL || b->tile->type != TILE_TYPE_WALL ||
+       abs(a->map_x - b->map_x) != side ||
+       abs(a->map_y - b->map_y) != !side))
+    return 0;
+  if (fmaxf(a->dist, b->dist) * sqrtf(plane2) * (hi_x - lo_x) >= 1.0f)
+    return 0;
+
+  // walls are hit on the face towards the camera, doors in the middle
+  const Camera *cam = job->camera;
+  int door = a->tile->type == TILE_TYPE_DOOR;
+  float dist, along;
+  int cell;
+  if (side == 0) {
+    float face = a->map_x + (door ? 0.5f : ray_dir_x < 0.0f);
+    dist = (face - cam->pos_x) / ray_dir_x;
+    along = cam->pos_y + dist * ray_dir_y;
+    cell = a->map_y;
+  } else {
+    float face = a->map_y + (door ? 0.5f : ray_dir_y < 0.0f);
+    dist = (face - cam->pos_y) / ray_dir_y;
+    along = cam->pos_x + dist * ray_dir_x;
+    cell = a->map_x;
+  }
+  *hit = (int)floorf(along) == cell ? *a : *b;
+  hit->dist = dist;
+  return 1;
+}
+
+// Picks the packet traversal for the running CPU, the scalar DDA otherwise.
+static const char *select_ray_kernel(void) {
+#if HAVE_X86_SIMD && PACKET_RAYS
+  if (SDL_HasAVX2()) {
+    ray_kernel = cast_rays_avx2;
+    return "avx2";
+  }
+#endif
+  ray_kernel = cast_rays_scalar;
+  return "scalar";
+}
+
+// Columns [x0, x1) that draw the same texture column with the same
+// placement and light, so they share one pass over the rows. No texels
+// means sky.
+typedef struct {
+  int x0, x1;
+  const uint32_t *texels;
+  int tex_height;
+  int draw_start, draw_end;
+  int64_t tex_pos;   // texel row at draw_start, 32.32 fixed point
+  uint64_t tex_step; // texel rows per screen row
+  Light light;
+} WallSpan;
+
+static inline int same_wall_span(const WallSpan *a, const WallSpan *b) {
+  return a->texels == b->texels && a->draw_start == b->draw_start &&
+         a->draw_end == b->draw_end && a->tex_pos == b->tex_pos &&
+         a->tex_step == b->tex_step && a->light.scale == b->light.scale &&
+         a->light.fog == b->light.fog;
+}
+
+// floor(d * tex_height / (256 * line_height)) in 32.32 fixed point, d being
+// the screen row's offset from the top of the wall in 1/256 pixels.
+static inline int64_t wall_tex_pos(int64_t d, int tex_height,
+                                   int line_height) {
+  if (d < 0) {
+    uint64_t n = ((uint64_t)-d * tex_height) << 24;
+    return -(int64_t)((n + line_height - 1) / line_height);
+  }
+  uint64_t n = (uint64_t)d * tex_height;
+  return (int64_t)(((n / line_height) << 24) +
+                   ((n % line_height) << 24) / line_height);
+}
+
+// Places a texture column of tex_height texels on a one cell tall wall or
+// sprite line_height pixels high, centred on the horizon.
+static void place_column(WallSpan *span, int height, int line_height,
+                         int tex_height) {
+  span->draw_start = maxi(0, (height - line_height) / 2);
+  span->draw_end = mini(height - 1, (height + line_height) / 2);
+  span->tex_height = tex_height;
+
+  // one divide per column, the rows then step through the texels; the step
+  // rounds up so rows never land below their exact texel
+  int64_t d = (int64_t)span->draw_start * 256 - (int64_t)height * 128 +
+              (int64_t)line_height * 128;
+  span->tex_pos = wall_tex_pos(d, tex_height, line_height);
+  span->tex_step = (((uint64_t)tex_height << 32) + line_height - 1) /
+                   (uint64_t)line_height;
+}
+
+static void draw_wall_span(const Framebuffer *fb, const WallSpan *span) {
+  if (!span->texels) {
+    for (int x = span->x0; x < span->x1; x++)
+      vertical_line(fb, x, 0, fb->height - 1, SKY_COLOR);
+    return;
+  }
+
+  int64_t pos = span->tex_pos;
+  uint8_t *line = fb->pixels + (size_t)span->draw_start * fb->pitch;
+  for (int y = span->draw_start; y <= span->draw_end; y++) {
+    int tex_y = mini(maxi((int)(pos >> 32), 0), span->tex_height - 1);
+    uint32_t color = 0xFF000000u | shade(span->texels[tex_y], span->light);
+
+    uint32_t *row = (uint32_t *)line;
+    for (int x = span->x0; x < span->x1; x++)
+      row[x] = color;
+    pos += (int64_t)span->tex_step;
+    line += fb->pitch;
+  }
+}
+
+// Wall columns [c0, c1), their rays cast in packets.
+static void render_walls(const RenderJob *job, int c0, int c1) {
+  const Framebuffer *fb = &job->fb;
+  const float *camera_lut = job->camera_lut;
+  const Camera *camera = job->camera;
+  const struct Map *map = job->map;
+  int columns = job->wall_columns;
+  float ray_pos_x = camera->pos_x;
+  float ray_pos_y = camera->pos_y;
+  WallSpan span = {0};
+
+  for (int p = c0; p < c1; p += RAY_PACKET) {
+    int count = mini(RAY_PACKET, c1 - p);
+    int xs[RAY_PACKET + 1];
+    float dirs_x[RAY_PACKET], dirs_y[RAY_PACKET];
+    RayHit rays[RAY_PACKET];
+
+    for (int i = 0; i <= count; i++)
+      xs[i] = split_range(0, fb->width, p + i, columns);
+    for (int i = 0; i < count; i++) {
+      float camera_x = camera_lut[(xs[i] + xs[i + 1] - 1) / 2];
+      dirs_x[i] = camera->dir_x + camera->plane_x * camera_x;
+      dirs_y[i] = camera->dir_y + camera->plane_y * camera_x;
+    }
+    int cast[RAY_PACKET], cast_count = 0;
+    for (int i = 0; i < count; i++)
+      if (!job->rays || !job->rays->reuse ||
+          !reproject_hit(job, dirs_x[i], dirs_y[i], &rays[i]))
+        cast[cast_count++] = i;
+    // a packet costs about as much as RAY_PACKET_MIN rays cast one by one
+    if (count == RAY_PACKET &&
+        (cast_count == RAY_PACKET ||
+         (cast_count >= RAY_PACKET_MIN && ray_kernel != cast_rays_scalar))) {
+      ray_kernel(map, ray_pos_x, ray_pos_y, dirs_x, dirs_y, rays);
+    } else {
+      for (int k = 0; k < cast_count; k++) {
+        int i = cast[k];
+        rays[i] = cast_ray(map, ray_pos_x, ray_pos_y, dirs_x[i], dirs_y[i]);
+      }
+    }
+    if (job->rays)
+      memcpy(job->rays->hits[job->rays->current ^ 1] + p, rays,
+             count * sizeof(RayHit));
+
+    for (int i = 0; i < count; i++) {
+      int c = p + i;
+      float ray_dir_x = dirs_x[i];
+      float ray_dir_y = dirs_y[i];
+      RayHit ray = rays[i];
+      WallSpan next = {.x0 = xs[i], .x1 = xs[i + 1]};
+      Tile *hit_tile = ray.tile;
+      int hit_side = ray.side;
+      float perp_wall_dist = FLT_MAX;
+
+      if (hit_tile) {
+        perp_wall_dist = ray.dist;
+        if (perp_wall_dist < 1e-6f)
+          perp_wall_dist = 1e-6f;
+
+        float wall_x = (hit_side == 0)
+                           ? (ray_pos_y + perp_wall_dist * ray_dir_y)
+                           : (ray_pos_x + perp_wall_dist * ray_dir_x);
+        wall_x -= floorf(wall_x) + ray.tex_shift;
+
+        int line_height = maxi((int)(fb->height / perp_wall_dist), 1);
+        const TileMip *mip = &hit_tile->mips[mip_level(
+            hit_tile, (float)hit_tile->height / line_height)];
+
+        int tex_x = (int)(wall_x * mip->width) & (mip->width - 1);
+        if ((hit_side == 0 && ray_dir_x > 0) ||
+            (hit_side == 1 && ray_dir_y < 0)) {
+          tex_x = mip->width - 1 - tex_x;
+        }
+        next.texels = mip->columns + (size_t)tex_x * mip->height;
+        place_column(&next, fb->height, line_height, mip->height);
+
+        // y-sides are dimmed on top of the fog
+        next.light = light_at(perp_wall_dist);
+        if (hit_side)
+          next.light.scale = next.light.scale * WALL_DIM_FACTOR >> 8;
+      }
+      for (int x = next.x0; x < next.x1; x++)
+        job->depth[x] = perp_wall_dist;
+
+      if (c > c0 && same_wall_span(&span, &next)) {
+        span.x1 = next.x1;
+      } else {
+        if (c > c0)
+          draw_wall_span(fb, &span);
+        span = next;
+      }
+    }
+  }
+
+  if (c1 > c0)
+    draw_wall_span(fb, &span);
+}
+
+// A sprite in view, placed on screen. rows holds its columns' placement
+// and light, the texels are picked per column.
+struct VisibleSprite {
+  float depth; // along the view direction
+  const TileMip *mip;
+  int left;  // first screen column, may be off screen
+  int width; // in columns, before clipping
+  WallSpan rows; // x0 and x1 clipped to the screen
+};
+
+static inline void to_view(const Camera *c, float inv_det, float x, float y,
+                           float *view_x, float *depth) {
+  float dx = x - c->pos_x;
+  float dy = y - c->pos_y;
+  *view_x = inv_det * (c->dir_y * dx - c->dir_x * dy);
+  *depth = inv_det * (c->plane_x * dy - c->plane_y * dx);
+}
+
+static int compare_sprite_depth(const void *a, const void *b) {
+  float da = ((const VisibleSprite *)a)->depth;
+  float db = ((const VisibleSprite *)b)->depth;
+  return (da < db) - (da > db);
+}
+
+// Culls the map's sprites against the view and places the visible ones,
+// sorted far to near, into sprite_view from index first on. Returns the end
+// of them. Only the grid buckets in the view triangle are visited, which
+// reaches out to the farthest wall.
+static int collect_sprites(const RenderJob *job, int first) {
+  const SpriteGrid *g = &job->map->sprites;
+  const Camera *c = job->camera;
+  const Framebuffer *fb = &job->fb;
+  if (g->count == 0)
+    return first;
+
+  float far = 0.0f;
+  for (int x = 0; x < fb->width; x++)
+    far = fmaxf(far, job->depth[x]);
+  far = fminf(far, SPRITE_MAX_DISTANCE);
+
+  // in view space a column is on screen while |view_x| <= depth; sprites
+  // are as wide as they are tall, and reach this much further out
+  float margin = (float)fb->height / fb->width;
+  float inv_det = 1.0f / (c->plane_x * c->dir_y - c->dir_x * c->plane_y);
+
+  float plane_len = sqrtf(c->plane_x * c->plane_x + c->plane_y * c->plane_y);
+  float pad = 1.0f + margin * plane_len;
+  float left_x = c->pos_x + (c->dir_x - c->plane_x) * far;
+  float left_y = c->pos_y + (c->dir_y - c->plane_y) * far;
+  float right_x = c->pos_x + (c->dir_x + c->plane_x) * far;
+  float right_y = c->pos_y + (c->dir_y + c->plane_y) * far;
+  int bx0 = (int)floorf((fminf(c->pos_x, fminf(left_x, right_x)) - pad) /
+                        SPRITE_BUCKET_SIZE);
+  int bx1 = (int)floorf((fmaxf(c->pos_x, fmaxf(left_x, right_x)) + pad) /
+                        SPRITE_BUCKET_SIZE);
+  int by0 = (int)floorf((fminf(c->pos_y, fminf(left_y, right_y)) - pad) /
+                        SPRITE_BUCKET_SIZE);
+  int by1 = (int)floorf((fmaxf(c->pos_y, fmaxf(left_y, right_y)) + pad) /
+                        SPRITE_BUCKET_SIZE);
+  bx0 = maxi(bx0, 0), bx1 = mini(bx1, g->buckets_x - 1);
+  by0 = maxi(by0, 0), by1 = mini(by1, g->buckets_y - 1);
+
+  int count = first;
+  for (int by = by0; by <= by1; by++) {
+    for (int bx = bx0; bx <= bx1; bx++) {
+      int b = by * g->buckets_x + bx;
+      if (g->bucket_start[b] == g->bucket_start[b + 1])
+        continue;
+
+      // skip buckets wholly behind, beyond or beside the view
+      int behind = 0, beyond = 0, left = 0, right = 0;
+      for (int k = 0; k < 4; k++) {
+        float vx, vd;
+        to_view(c, inv_det, (float)((bx + (k & 1)) * SPRITE_BUCKET_SIZE),
+                (float)((by + (k >> 1)) * SPRITE_BUCKET_SIZE), &vx, &vd);
+        behind += vd < SPRITE_NEAR;
+        beyond += vd > far;
+        left += -vx > vd + margin;
+        right += vx > vd + margin;
+      }
+      if (behind == 4 || beyond == 4 || left == 4 || right == 4)
+        continue;
+
+      for (int k = g->bucket_start[b]; k < g->bucket_start[b + 1]; k++) {
+        const Sprite *sp = &g->sprites[g->order[k]];
+        float vx, vd;
+        to_view(c, inv_det, sp->x, sp->y, &vx, &vd);
+        if (vd < SPRITE_NEAR || vd > far)
+          continue;
+
+        const Tile *tile = sp->id < MAX_TILE_ID ? id_lut[sp->id] : NULL;
+        int line_height = maxi((int)(fb->height / vd), 1);
+        int center = (int)(fb->width / 2 * (1.0f + vx / vd));
+        int x0 = center - line_height / 2;
+        if (!tile || x0 >= fb->width || x0 + line_height <= 0)
+          continue;
+        const TileMip *mip =
+            &tile->mips[mip_level(tile, (float)tile->height / line_height)];
+        if (!mip->columns)
+          continue;
+
+        if (count == sprite_view.capacity) {
+          int capacity = sprite_view.capacity ? sprite_view.capacity * 2 : 256;
+          VisibleSprite *items =
+              realloc(sprite_view.items, capacity * sizeof(VisibleSprite));
+          if (!items)
+            goto sort;
+          sprite_view.items = items;
+          sprite_view.capacity = capacity;
+        }
+
+        VisibleSprite *v = &sprite_view.items[count++];
+        v->depth = vd;
+        v->mip = mip;
+        v->left = x0;
+        v->width = line_height;
+        v->rows = (WallSpan){.x0 = maxi(x0, 0),
+                             .x1 = mini(x0 + line_height, fb->width),
+                             .light = light_at(vd)};
+        place_column(&v->rows, fb->height, line_height, mip->height);
+      }
+    }
+  }
+
+sort:
+  if (count - first > 1)
+    qsort(sprite_view.items + first, count - first, sizeof(VisibleSprite),
+          compare_sprite_depth);
+  return count;
+}
+
+// draw_wall_span() for sprites, leaving see-through texels out.
+static void draw_sprite_span(const Framebuffer *fb, const WallSpan *span) {
+  int64_t pos = span->tex_pos;
+  uint8_t *line = fb->pixels + (size_t)span->draw_start * fb->pitch;
+  for (int y = span->draw_start; y <= span->draw_end; y++) {
+    int tex_y = mini(maxi((int)(pos >> 32), 0), span->tex_height - 1);
+    uint32_t texel = span->texels[tex_y];
+    if (texel >> 24 >= SPRITE_ALPHA_MIN) {
+      uint32_t color = 0xFF000000u | shade(texel, span->light);
+      uint32_t *row = (uint32_t *)line;
+      for (int x = span->x0; x < span->x1; x++)
+        row[x] = color;
+    }
+    pos += (int64_t)span->tex_step;
+    line += fb->pitch;
+  }
+}
+
+// Draws the part of a sprite in screen columns [x0, x1): runs of columns
+// in front of the walls that show the same texture column are drawn as one
+// span, hidden columns are skipped without touching the texels.
+static void draw_sprite(const RenderJob *job, const VisibleSprite *v, int x0,
+                        int x1) {
+  const float *depth = job->depth;
+  const TileMip *mip = v->mip;
+  x0 = maxi(x0, v->rows.x0);
+  x1 = mini(x1, v->rows.x1);
+
+  for (int x = x0; x < x1;) {
+    if (depth[x] <= v->depth) {
+      x++;
+      continue;
+    }
+    int tex_x = (int)((int64_t)(x - v->left) * mip->width / v->width);
+    WallSpan span = v->rows;
+    span.x0 = x;
+    do
+      x++;
+    while (x < x1 && depth[x] > v->depth &&
+           (int)((int64_t)(x - v->left) * mip->width / v->width) == tex_x);
+    span.x1 = x;
+    span.texels = mip->columns + (size_t)tex_x * mip->height;
+    draw_sprite_span(&job->fb, &span);
+  }
+}
+
+// One camera's view, drawn into a rectangle of the frame. The LUTs only
+// depend on the rectangle's size, so views of the same size can share them.
+typedef struct {
+  int x, y, width, height;
+  const Camera *camera;
+  const float *camera_lut; // width entries
+  const float *row_lut;    // height - height / 2 entries
+  float *depth;            // width floats
+  RayCache *rays;          // NULL to cast every wall ray
+  int wall_columns;
+} View;
+
+// Views drawn together. Each pass runs as one pool job over all of them,
+// their work laid end to end and split evenly across the threads, so every
+// thread stays busy whatever the views' sizes.
+typedef struct {
+  RenderJob jobs[MAX_VIEWS];
+  int count;
+} ViewBatch;
+
+static void batch_split(const ViewBatch *batch, int index, int count,
+                        int (*size)(const RenderJob *),
+                        void (*pass)(const RenderJob *, int, int)) {
+  int total = 0;
+  for (int i = 0; i < batch->count; i++)
+    total += size(&batch->jobs[i]);
+
+  int begin = split_range(0, total, index, count);
+  int end = split_range(0, total, index + 1, count);
+  for (int i = 0, offset = 0; i < batch->count && offset < end; i++) {
+    int n = size(&batch->jobs[i]);
+    int b0 = maxi(begin - offset, 0), b1 = mini(end - offset, n);
+    if (b0 < b1)
+      pass(&batch->jobs[i], b0, b1);
+    offset += n;
+  }
+}
+
+static int floor_rows(const RenderJob *job) {
+  return job->fb.height - job->fb.height / 2;
+}
+
+static void floor_pass(const RenderJob *job, int r0, int r1) {
+  int half = job->fb.height / 2;
+  render_floor(job, half + r0, half + r1);
+}
+
+static int wall_count(const RenderJob *job) { return job->wall_columns; }
+
+static int sprite_columns(const RenderJob *job) {
+  return job->sprite_count > 0 ? job->fb.width : 0;
+}
+
+static void sprite_pass(const RenderJob *job, int x0, int x1) {
+  for (int i = 0; i < job->sprite_count; i++)
+    draw_sprite(job, &job->sprites[i], x0, x1);
+}
+
+static void floor_job(void *ctx, int index, int count) {
+  batch_split(ctx, index, count, floor_rows, floor_pass);
+}
+
+static void wall_job(void *ctx, int index, int count) {
+  batch_split(ctx, index, count, wall_count, render_walls);
+}
+
+static void sprite_job(void *ctx, int index, int count) {
+  batch_split(ctx, index, count, sprite_columns, sprite_pass);
+}
+
+static RenderJob view_job(const View *v, const Framebuffer *fb,
+                          const struct Map *map) {
+  RenderJob job = {
+      .camera_lut = v->camera_lut,
+      .row_lut = v->row_lut,
+      .depth = v->depth,
+      .fb = {.pixels = fb->pixels + (size_t)v->y * fb->pitch + v->x * 4,
+             .pitch = fb->pitch,
+             .width = v->width,
+             .height = v->height},
+      .wall_columns = mini(maxi(v->wall_columns, 1), v->width),
+      .camera = v->camera,
+      .map = map,
+      .rays = v->rays && v->width <= v->rays->capacity ? v->rays : NULL,
+  };
+
+  RayCache *rays = job.rays;
+  if (rays)
+    rays->reuse = rays->columns == job.wall_columns &&
+                  rays->width == v->width && rays->revision == map->revision &&
+                  rays->camera.pos_x == v->camera->pos_x &&
+                  rays->camera.pos_y == v->camera->pos_y;
+  return job;
+}
+
+static void render_batch(WorkerPool *pool, ViewBatch *batch,
+                         const struct Map *map) {
+  profile_begin(SCOPE_FLOOR);
+  pool_run(pool, floor_job, batch);
+  profile_end(SCOPE_FLOOR);
+
+  profile_begin(SCOPE_WALLS);
+  pool_run(pool, wall_job, batch);
+  profile_end(SCOPE_WALLS);
+  for (int i = 0; i < batch->count; i++) {
+    RenderJob *job = &batch->jobs[i];
+    if (job->rays) {
+      job->rays->current ^= 1;
+      job->rays->columns = job->wall_columns;
+      job->rays->width = job->fb.width;
+      job->rays->camera = *job->camera;
+      job->rays->revision = map->revision;
+    }
+  }
+
+  // every view's sprites go into sprite_view one after the other, which
+  // may move while it grows
+  int first[MAX_VIEWS], total = 0;
+  profile_begin(SCOPE_SPRITES);
+  for (int i = 0; i < batch->count; i++) {
+    first[i] = total;
+    total = collect_sprites(&batch->jobs[i], total);
+    batch->jobs[i].sprite_count = total - first[i];
+  }
+  for (int i = 0; i < batch->count; i++)
+    batch->jobs[i].sprites = sprite_view.items + first[i];
+  if (total > 0)
+    pool_run(pool, sprite_job, batch);
+  profile_end(SCOPE_SPRITES);
+}
+
+static inline int views_overlap(const View *a, const View *b) {
+  return a->x < b->x + b->width && b->x < a->x + a->width &&
+         a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+// Every band/strip writes a disjoint set of pixels, so the output does not
+// depend on the number of threads. The walls must go after the floor since
+// they overdraw it, and the sprites last, tested against the walls' depth.
+// Floor, ceiling, walls and sky cover each view's whole rectangle, so the
+// framebuffer is never cleared. Views that overlap an earlier one are drawn
+// after it, on top; the others are drawn together. They only share the map,
+// the tiles and their LUTs, all read-only.
+static void render_views(WorkerPool *pool, const View *views, int count,
+                         const Framebuffer *fb, const struct Map *map) {
+  ViewBatch batch;
+  for (int i = 0; i < count;) {
+    batch.count = 0;
+    for (; i < count && batch.count < MAX_VIEWS; i++) {
+      int overlap = 0;
+      for (int j = i - batch.count; j < i; j++)
+        overlap |= views_overlap(&views[i], &views[j]);
+      if (overlap)
+        break;
+      batch.jobs[batch.count++] = view_job(&views[i], fb, map);
+    }
+    render_batch(pool, &batch, map);
+  }
+}
+
+#ifndef RAYCASTER_LIBRARY
+// The streaming texture frames are rendered into and its views, each with
+// its per-column camera and per-row floor distance LUTs, depth buffer and
+// ray cache, all at the internal render resolution. The texture keeps the
+// last frame, which is shown again as long as nothing it depends on
+// changed. The pipelined main loop renders into two CPU buffers instead and
+// uploads them in turn.
+typedef struct {
+  SDL_Texture *texture;
+  uint32_t *buffers[2];
+  int front;   // buffers[front] holds the newest finished frame
+  int pending; // that frame wasn't uploaded to the texture yet
+  View views[MAX_VIEWS];
+  Camera cameras[MAX_VIEWS]; // the views' cameras for the frame
+  float turns[MAX_VIEWS];    // radians from the camera's direction
+  float fovs[MAX_VIEWS];     // plane scale keeping the frame's proportions
+  RayCache rays[MAX_VIEWS];
+  int view_count;
+  float *luts[2 * MAX_VIEWS]; // shared by views of the same size
+  int lut_count;
+  float *depth;
+  int split; // the layout of the views
+  int pip;
+  int width;
+  int height;
+  int valid; // the texture holds the frame below
+  Camera camera;
+  int wall_columns;
+  unsigned map_revision;
+  unsigned tile_revision;
+  int skipped; // the last render_frame() call kept the frame
+} RenderTarget;
+
+static int clamp_render_scale(int scale_percent) {
+  return scale_percent < RENDER_SCALE_MIN ? RENDER_SCALE_MIN
+         : scale_percent > 100          ? 100
+                                        : scale_percent;
+}
+
+static void render_target_destroy(RenderTarget *rt) {
+  SDL_DestroyTexture(rt->texture);
+  free(rt->buffers[0]);
+  free(rt->buffers[1]);
+  for (int i = 0; i < rt->lut_count; i++)
+    free(rt->luts[i]);
+  for (int i = 0; i < MAX_VIEWS; i++) {
+    free(rt->rays[i].hits[0]);
+    free(rt->rays[i].hits[1]);
+  }
+  free(rt->depth);
+  memset(rt, 0, sizeof(*rt));
+}
+
+static void add_view(RenderTarget *rt, int x, int y, int w, int h,
+                     float turn) {
+  View *v = &rt->views[rt->view_count];
+  *v = (View){.x = x, .y = y, .width = w, .height = h};
+  rt->turns[rt->view_count] = turn;
+  rt->fovs[rt->view_count] =
+      ((float)w / h) / ((float)rt->width / rt->height);
+  rt->view_count++;
+}
+
+// Splits the target into split views side by side, or a 2x2 grid for 4,
+// looking all around the camera clockwise, and with pip puts a rear view
+// inset in the top right corner on top.
+static void layout_views(RenderTarget *rt, int split, int pip) {
+  static const int grid[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+  int n = split >= 4 ? 4 : split >= 2 ? 2 : 1;
+  int cols = n >= 2 ? 2 : 1, rows = n >= 4 ? 2 : 1;
+  int w = rt->width, h = rt->height;
+
+  rt->view_count = 0;
+  for (int i = 0; i < n; i++) {
+    int c = grid[i][0], r = grid[i][1];
+    int x0 = split_range(0, w, c, cols), x1 = split_range(0, w, c + 1, cols);
+    int y0 = split_range(0, h, r, rows), y1 = split_range(0, h, r + 1, rows);
+    add_view(rt, x0, y0, x1 - x0, y1 - y0, -2.0f * (float)M_PI * i / n);
+  }
+
+  if (pip) {
+    int pw = maxi(1, w * PIP_SCALE / 100), ph = maxi(2, h * PIP_SCALE / 100);
+    int margin = mini(w - pw, h - ph) / 16;
+    add_view(rt, w - pw - margin, margin, pw, ph, (float)M_PI);
+  }
+}
+
+// (Re)creates the target for an output of output_w x output_h pixels at
+// scale_percent of that resolution, split into views as layout_views()
+// does. The old target stays if this fails.
+static int render_target_resize(RenderTarget *rt, SDL_Renderer *renderer,
+                                int output_w, int output_h, int scale_percent,
+                                int split, int pip) {
+  int w = maxi(1, output_w * scale_percent / 100);
+  int h = maxi(2, output_h * scale_percent / 100);
+  if (rt->texture && w == rt->width && h == rt->height &&
+      split == rt->split && pip == rt->pip)
+    return 1;
+
+  RenderTarget next = {.split = split, .pip = pip, .width = w, .height = h};
+  next.texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                   SDL_TEXTUREACCESS_STREAMING, w, h);
+  if (!next.texture) {
+    fprintf(stderr, "SDL_CreateTexture Error: %s\n", SDL_GetError());
+    return 0;
+  }
+
+  size_t frame_size = (size_t)w * h * sizeof(uint32_t);
+  next.buffers[0] = malloc(frame_size);
+  next.buffers[1] = malloc(frame_size);
+  int ok = next.buffers[0] && next.buffers[1];
+
+  layout_views(&next, split, pip);
+  int depth_size = 0;
+  for (int i = 0; i < next.view_count; i++)
+    depth_size += next.views[i].width;
+  next.depth = malloc(depth_size * sizeof(float));
+  ok &= next.depth != NULL;
+
+  for (int i = 0, offset = 0; ok && i < next.view_count; i++) {
+    View *v = &next.views[i];
+    for (int j = 0; j < i; j++) {
+      if (next.views[j].width == v->width)
+        v->camera_lut = next.views[j].camera_lut;
+      if (next.views[j].height == v->height)
+        v->row_lut = next.views[j].row_lut;
+    }
+    if (!v->camera_lut)
+      v->camera_lut = next.luts[next.lut_count++] =
+          generate_camera_lut(v->width);
+    if (!v->row_lut)
+      v->row_lut = next.luts[next.lut_count++] = generate_row_lut(v->height);
+    v->depth = next.depth + offset;
+    offset += v->width;
+
+    RayCache *rays = &next.rays[i];
+    rays->hits[0] = malloc(v->width * sizeof(RayHit));
+    rays->hits[1] = malloc(v->width * sizeof(RayHit));
+    rays->capacity = v->width;
+    ok = v->camera_lut && v->row_lut && rays->hits[0] && rays->hits[1];
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Memory allocation failed for camera LUT\n");
+    render_target_destroy(&next);
+    return 0;
+  }
+
+  render_target_destroy(rt);
+  *rt = next;
+  return 1;
+}
+
+// Points the target's views at the frame's camera and renders them into fb.
+static void render_target_draw(WorkerPool *pool, RenderTarget *rt,
+                               const Framebuffer *fb, int wall_scale,
+                               const Camera *camera, const struct Map *map) {
+  for (int i = 0; i < rt->view_count; i++) {
+    Camera *c = &rt->cameras[i];
+    *c = *camera;
+    if (rt->turns[i] != 0.0f)
+      rotate_camera(c, rt->turns[i]);
+    if (rt->fovs[i] != 1.0f) {
+      c->plane_x *= rt->fovs[i];
+      c->plane_y *= rt->fovs[i];
+    }
+
+    View *v = &rt->views[i];
+    v->camera = c;
+    v->rays = &rt->rays[i];
+    v->wall_columns = v->width * wall_scale / 100;
+  }
+  render_views(pool, rt->views, rt->view_count, fb, map);
+}
+
+// Keeps the frame's render time under budget_ms by trading resolution:
+// over budget it lowers the render scale first and then the wall column
+// count, and with enough headroom it restores them in reverse order.
+typedef struct {
+  float budget_ms; // 0 disables the controller
+  float average_ms;
+  int settle;
+  int render_scale;
+  int wall_scale;
+} ResolutionController;
+
+// Feeds one frame's render time; returns 1 when the render scale changed and
+// the target has to be resized.
+static int dynres_update(ResolutionController *dr, float frame_ms) {
+  if (dr->budget_ms <= 0.0f)
+    return 0;
+
+  dr->average_ms =
+      dr->average_ms > 0.0f
+          ? dr->average_ms + (frame_ms - dr->average_ms) * DYNRES_SMOOTHING
+          : frame_ms;
+  if (dr->settle > 0) {
+    dr->settle--;
+    return 0;
+  }
+
+  int render_scale = dr->render_scale;
+  if (dr->average_ms > dr->budget_ms) {
+    if (dr->render_scale > RENDER_SCALE_MIN)
+      dr->render_scale =
+          clamp_render_scale(dr->render_scale - RENDER_SCALE_STEP);
+    else
+      dr->wall_scale = maxi(dr->wall_scale - RENDER_SCALE_STEP, WALL_SCALE_MIN);
+  } else if (dr->average_ms < dr->budget_ms * DYNRES_HEADROOM) {
+    if (dr->wall_scale < 100)
+      dr->wall_scale = mini(dr->wall_scale + RENDER_SCALE_STEP, 100);
+    else
+      dr->render_scale =
+          clamp_render_scale(dr->render_scale + RENDER_SCALE_STEP);
+  } else {
+    return 0;
+  }
+
+  dr->settle = DYNRES_SETTLE_FRAMES;
+#if DEBUG
+  fprintf(stderr, "Dynamic resolution: %.2f ms, render %d%%, walls %d%%\n",
+          dr->average_ms, dr->render_scale, dr->wall_scale);
+#endif
+  return dr->render_scale != render_scale;
+}
+
+// Whether the target's last frame already shows this view.
+static int frame_unchanged(const RenderTarget *rt, int wall_columns,
+                           const Camera *camera, const struct Map *map) {
+  return rt->valid && same_camera(&rt->camera, camera) &&
+         rt->wall_columns == wall_columns &&
+         rt->map_revision == map->revision &&
+         rt->tile_revision == tile_loader.revision;
+}
+
+static void frame_rendered(RenderTarget *rt, int wall_columns,
+                           const Camera *camera, const struct Map *map) {
+  rt->valid = 1;
+  rt->camera = *camera;
+  rt->wall_columns = wall_columns;
+  rt->map_revision = map->revision;
+  rt->tile_revision = tile_loader.revision;
+}
+
+// Renders a frame straight into the target's texture, unless the one in
+// there already shows this view, and sets rt->skipped accordingly. Unlocking
+// the texture uploads the frame. wall_scale is the share of the target's
+// columns, in percent, that the wall pass casts rays for.
+static int render_frame(WorkerPool *pool, RenderTarget *rt, int wall_scale,
+                        Camera *camera, const struct Map *map) {
+  Framebuffer fb = {.width = rt->width, .height = rt->height};
+  int wall_columns = rt->width * wall_scale / 100;
+  void *pixels;
+
+  rt->skipped = frame_unchanged(rt, wall_columns, camera, map);
+  if (rt->skipped)
+    return 1;
+
+  profile_begin(SCOPE_LOCK);
+  int locked = SDL_LockTexture(rt->texture, NULL, &pixels, &fb.pitch) == 0;
+  profile_end(SCOPE_LOCK);
+  if (!locked) {
+    fprintf(stderr, "SDL_LockTexture Error: %s\n", SDL_GetError());
+    return 0;
+  }
+
+  fb.pixels = pixels;
+  render_target_draw(pool, rt, &fb, wall_scale, camera, map);
+
+  profile_begin(SCOPE_UPLOAD);
+  SDL_UnlockTexture(rt->texture);
+  profile_end(SCOPE_UPLOAD);
+
+  frame_rendered(rt, wall_columns, camera, map);
+  return 1;
+}
+
+// Rasterizes frames on a thread of its own, which drives the worker pool,
+// so the main thread can upload and present the previous frame meanwhile.
+// At most one frame is in flight, and the main thread waits for it before
+// it touches the map or the render target again.
+typedef struct {
+  SDL_Thread *thread;
+  SDL_mutex *lock;
+  SDL_cond *cond;
+  int queued; // a frame was submitted and not collected yet
+  int done;
+  int quit;
+  WorkerPool *pool;
+  RenderTarget *rt;
+  Framebuffer fb;
+  int wall_scale;
+  Camera camera;
+  const struct Map *map;
+  ProfileFrame timings; // scopes of the frame, timed on the frame thread
+  Uint64 ticks;         // render time of the frame
+  Uint64 last_ticks;    // render time of the last frame collected
+} FrameThread;
+
+static int frame_thread_main(void *data) {
+  FrameThread *ft = data;
+  profile_thread_frame = &ft->timings;
+
+  SDL_LockMutex(ft->lock);
+  for (;;) {
+    while (!ft->quit && (!ft->queued || ft->done))
+      SDL_CondWait(ft->cond, ft->lock);
+    if (ft->quit)
+      break;
+    SDL_UnlockMutex(ft->lock);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    memset(&ft->timings, 0, sizeof(ft->timings));
+    render_target_draw(ft->pool, ft->rt, &ft->fb, ft->wall_scale, &ft->camera,
+                       ft->map);
+    ft->ticks = SDL_GetPerformanceCounter() - start;
+
+    SDL_LockMutex(ft->lock);
+    ft->done = 1;
+    SDL_CondSignal(ft->cond);
+  }
+  SDL_UnlockMutex(ft->lock);
+
+  sprite_view_free();
+  return 0;
+}
+
+static void frame_thread_stop(FrameThread *ft) {
+  if (ft->thread) {
+    SDL_LockMutex(ft->lock);
+    ft->quit = 1;
+    SDL_CondSignal(ft->cond);
+    SDL_UnlockMutex(ft->lock);
+    SDL_WaitThread(ft->thread, NULL);
+  }
+
+  if (ft->cond)
+    SDL_DestroyCond(ft->cond);
+  if (ft->lock)
+    SDL_DestroyMutex(ft->lock);
+  memset(ft, 0, sizeof(*ft));
+}
+
+static int frame_thread_start(FrameThread *ft, WorkerPool *pool) {
+  memset(ft, 0, sizeof(*ft));
+  ft->pool = pool;
+  ft->lock = SDL_CreateMutex();
+  ft->cond = SDL_CreateCond();
+  if (ft->lock && ft->cond)
+    ft->thread = SDL_CreateThread(frame_thread_main, "frame", ft);
+  if (!ft->thread) {
+    fprintf(stderr, "Failed to start the frame thread, not pipelining\n");
+    frame_thread_stop(ft);
+    return 0;
+  }
+  return 1;
+}
+
+// Hands the view to the frame thread, which renders it into the target's
+// back buffer, unless the target already shows it. Sets rt->skipped.
+static void frame_thread_submit(FrameThread *ft, RenderTarget *rt,
+                                int wall_scale, const Camera *camera,
+                                const struct Map *map) {
+  int wall_columns = rt->width * wall_scale / 100;
+  rt->skipped = frame_unchanged(rt, wall_columns, camera, map);
+  if (rt->skipped)
+    return;
+
+  SDL_LockMutex(ft->lock);
+  ft->rt = rt;
+  ft->fb = (Framebuffer){
+      .pixels = (uint8_t *)rt->buffers[rt->front ^ 1],
+      .pitch = rt->width * (int)sizeof(uint32_t),
+      .width = rt->width,
+      .height = rt->height,
+  };
+  ft->wall_scale = wall_scale;
+  ft->camera = *camera;
+  ft->map = map;
+  ft->queued = 1;
+  SDL_CondSignal(ft->cond);
+  SDL_UnlockMutex(ft->lock);
+
+  frame_rendered(rt, wall_columns, camera, map);
+}
+
+// Waits for the submitted frame, if there is one, and makes it the target's
+// front buffer. Returns 1 when a frame finished.
+static int frame_thread_wait(FrameThread *ft) {
+  if (!ft->queued)
+    return 0;
+
+  SDL_LockMutex(ft->lock);
+  while (!ft->done)
+    SDL_CondWait(ft->cond, ft->lock);
+  ft->queued = 0;
+  ft->done = 0;
+  ft->last_ticks = ft->ticks;
+  SDL_UnlockMutex(ft->lock);
+
+  ft->rt->front ^= 1;
+  ft->rt->pending = 1;
+  profile_merge(&ft->timings, 2);
+  return 1;
+}
+#endif
+
+static Camera initial_camera(void) {
+  Camera camera = {
+      .pos_x = 2.0f,
+      .pos_y = 2.0f,
+      .dir_x = -1.0f,
+      .dir_y = 0.0f,
+      .plane_x = 0.0f,
+      .plane_y = FOV_FACTOR,
+  };
+
+  float len = sqrtf(camera.dir_x * camera.dir_x + camera.dir_y * camera.dir_y);
+  if (len > 0.f) {
+    camera.dir_x /= len;
+    camera.dir_y /= len;
+  }
+
+  return camera;
+}
+
+// The API of raycaster.h. The tile registry and the map stream are global,
+// so there is one Raycaster at a time.
+struct Raycaster {
+  struct Map map;
+  WorkerPool pool;
+  float *camera_lut; // for frames lut_width pixels wide
+  float *row_lut;    // and lut_height high
+  float *depth;      // lut_width floats per render thread
+  int lut_width;
+  int lut_height;
+};
+
+static Raycaster *raycaster_active;
+
+void raycaster_destroy(Raycaster *rc) {
+  if (!rc)
+    return;
+  free(rc->camera_lut);
+  free(rc->row_lut);
+  free(rc->depth);
+  free_map(&rc->map);
+  free_tile_registry();
+  pool_destroy(&rc->pool);
+  sprite_view_free();
+  if (raycaster_active == rc)
+    raycaster_active = NULL;
+  free(rc);
+}
+
+Raycaster *raycaster_create(const char *pack_path, int threads) {
+  if (raycaster_active) {
+    fprintf(stderr, "Only one Raycaster can exist at a time\n");
+    return NULL;
+  }
+
+  Raycaster *rc = calloc(1, sizeof(*rc));
+  if (!rc) {
+    fprintf(stderr, "Memory allocation failed for Raycaster\n");
+    return NULL;
+  }
+  raycaster_active = rc;
+
+  pool_init(&rc->pool, threads);
+  select_floor_kernel();
+  select_ray_kernel();
+  init_lighting();
+  if (!load_world(pack_path, 0, &rc->map) || !tile_loader_wait()) {
+    raycaster_destroy(rc);
+    return NULL;
+  }
+
+  Camera start = initial_camera();
+  map_stream_update(&rc->map, &start, 1);
+  return rc;
+}
+
+void raycaster_map_size(const Raycaster *rc, int *width, int *height) {
+  *width = (int)rc->map.width;
+  *height = (int)rc->map.height;
+}
+
+int raycaster_is_open(const Raycaster *rc, int x, int y) {
+  return !is_solid(&rc->map, x, y);
+}
+
+int raycaster_move_agents(Raycaster *rc, float *x, float *y, const float *dx,
+                          const float *dy, int count, float radius) {
+  if (count < 0 || !(radius >= 0.0f && radius < 1.0f))
+    return 0;
+
+  AgentBatch batch = {&rc->map, x, y, dx, dy, count, radius};
+  move_agents(&rc->pool, &batch);
+  return 1;
+}
+
+// Builds the LUTs and depth buffers for frames of width x height.
+static int raycaster_prepare(Raycaster *rc, int width, int height) {
+  if (width < 1 || height < 2)
+    return 0;
+  if (rc->camera_lut && width == rc->lut_width && height == rc->lut_height)
+    return 1;
+
+  free(rc->camera_lut);
+  free(rc->row_lut);
+  free(rc->depth);
+  rc->camera_lut = generate_camera_lut(width);
+  rc->row_lut = generate_row_lut(height);
+  rc->depth = malloc((size_t)(rc->pool.thread_count + 1) * width *
+                     sizeof(float));
+  rc->lut_width = width;
+  rc->lut_height = height;
+  if (!rc->camera_lut || !rc->row_lut || !rc->depth) {
+    fprintf(stderr, "Memory allocation failed for camera LUT\n");
+    free(rc->camera_lut);
+    free(rc->row_lut);
+    free(rc->depth);
+    rc->camera_lut = rc->row_lut = rc->depth = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static View raycaster_view(const Raycaster *rc, const Camera *pose,
+                           int thread) {
+  return (View){
+      .width = rc->lut_width,
+      .height = rc->lut_height,
+      .camera = pose,
+      .camera_lut = rc->camera_lut,
+      .row_lut = rc->row_lut,
+      .depth = rc->depth + (size_t)thread * rc->lut_width,
+      .wall_columns = rc->lut_width,
+  };
+}
+
+int raycaster_render(Raycaster *rc, const RaycasterPose *pose,
+                     uint32_t *pixels, int width, int height, int pitch) {
+  if (!raycaster_prepare(rc, width, height))
+    return 0;
+
+  map_stream_update(&rc->map, pose, 1);
+  Framebuffer fb = {(uint8_t *)pixels, pitch, width, height};
+  View view = raycaster_view(rc, pose, 0);
+  render_views(&rc->pool, &view, 1, &fb, &rc->map);
+  return 1;
 }
 
-struct Map {
-  size_t width;
-  size_t height;
-  Tile **tiles;
-};
+typedef struct {
+  Raycaster *rc;
+  const Camera *poses;
+  int count;
+  uint32_t *frames;
+  SDL_atomic_t next; // pose to render next
+} FrameBatch;
 
-static struct Map load_map(const char *filename) {
-  struct Map map = {0, 0, NULL};
+// Renders one whole frame after another on every thread, until the poses
+// run out. The passes time themselves into a scratch frame rather than
+// the main thread's profiler.
+static void frame_batch_job(void *ctx, int index, int count) {
+  FrameBatch *batch = ctx;
+  const Raycaster *rc = batch->rc;
+  WorkerPool serial = {0}; // runs every pass on this thread
+  ProfileFrame scratch = {0}, *saved = profile_thread_frame;
+  size_t frame_size = (size_t)rc->lut_width * rc->lut_height;
+  (void)count;
 
-  FILE *file = fopen(filename, "r");
-  if (!file) {
-    fprintf(stderr, "Failed to open map file: %s\n", filename);
-    return map;
+  profile_thread_frame = &scratch;
+  for (int i; (i = SDL_AtomicAdd(&batch->next, 1)) < batch->count;) {
+    Framebuffer fb = {(uint8_t *)(batch->frames + i * frame_size),
+                      rc->lut_width * (int)sizeof(uint32_t), rc->lut_width,
+                      rc->lut_height};
+    View view = raycaster_view(rc, &batch->poses[i], index);
+    render_views(&serial, &view, 1, &fb, &rc->map);
   }
+  profile_thread_frame = saved;
+}
 
-  if (fscanf(file, "%zu %zu", &map.width, &map.height) != 2 || map.width <= 0 ||
-      map.height <= 0) {
-    fprintf(stderr, "Invalid map dimensions in file: %s\n", filename);
-    fclose(file);
-    return map;
+int raycaster_render_batch(Raycaster *rc, const RaycasterPose *poses,
+                           int count, uint32_t *frames, int width,
+                           int height) {
+  if (!raycaster_prepare(rc, width, height))
+    return 0;
+
+  // streamed maps have to load the chunks around every pose first
+  if (rc->map.stream) {
+    for (int i = 0; i < count; i++) {
+      if (!raycaster_render(rc, &poses[i],
+                            frames + (size_t)i * width * height, width,
+                            height, width * (int)sizeof(uint32_t)))
+        return 0;
+    }
+    return 1;
   }
 
-  map.tiles = calloc(map.width * map.height, sizeof *map.tiles);
-  if (!map.tiles) {
-    fclose(file);
-    map.width = map.height = 0;
-    return map;
+  FrameBatch batch = {.rc = rc, .poses = poses, .count = count,
+                      .frames = frames};
+  SDL_AtomicSet(&batch.next, 0);
+  pool_run(&rc->pool, frame_batch_job, &batch);
+  return 1;
+}
+
+#ifndef RAYCASTER_LIBRARY
+// A camera path is either loaded from a file written by --record (one
+// "pos_x pos_y dir_x dir_y plane_x plane_y" line per frame) or generated:
+// a slow walk that keeps turning, with collisions keeping it in the map.
+static Camera *load_camera_path(const char *filename, int *frame_count) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(stderr, "Failed to open camera path: %s\n", filename);
+    return NULL;
   }
 
-  for (size_t y = 0; y < map.height; y++) {
-    for (size_t x = 0; x < map.width; x++) {
-      unsigned hex;
-      if (fscanf(file, "%x", &hex) != 1) {
-        fprintf(stderr, "Premature end of map data at (%zu, %zu)\n", x, y);
-        free(map.tiles);
-        map.tiles = NULL;
-        map.width = map.height = 0;
-        fclose(file);
-        return map;
+  int cap = 256, n = 0;
+  Camera *path = malloc(cap * sizeof(Camera));
+  Camera c;
+  while (path && fscanf(f, "%f %f %f %f %f %f", &c.pos_x, &c.pos_y, &c.dir_x,
+                        &c.dir_y, &c.plane_x, &c.plane_y) == 6) {
+    if (n == cap) {
+      cap *= 2;
+      Camera *grown = realloc(path, cap * sizeof(Camera));
+      if (!grown) {
+        free(path);
+        path = NULL;
+        break;
       }
-      map.tiles[y * map.width + x] = get_tile_by_id(hex);
+      path = grown;
     }
+    path[n++] = c;
   }
+  fclose(f);
 
-  fclose(file);
-
-#if DEBUG
-  if (map.tiles == NULL)
-    fprintf(stderr, "Failed to load map tiles from file: %s\n", filename);
-#endif
+  if (!path || n == 0) {
+    fprintf(stderr, "No camera poses in %s\n", filename);
+    free(path);
+    return NULL;
+  }
 
-  return map;
+  *frame_count = n;
+  return path;
 }
 
-static inline Tile *get_tile(const struct Map *m, int x, int y) {
-  if ((unsigned)x >= m->width || (unsigned)y >= m->height)
+static Camera *generate_camera_path(const struct Map *map, int frame_count) {
+  Camera *path = malloc(frame_count * sizeof(Camera));
+  if (!path)
     return NULL;
-  return m->tiles[y * m->width + x];
-}
 
-static inline int is_solid(const struct Map *map, int x, int y) {
-  Tile *t = get_tile(map, x, y);
-  return !t || t->type == TILE_TYPE_WALL;
+  const float dt = 1.0f / 60.0f;
+  Camera camera = initial_camera();
+  for (int i = 0; i < frame_count; i++) {
+    float turn = sinf(i * 0.013f) * 0.6f + 0.25f;
+    rotate_camera(&camera, ROT_SPEED_SEC * dt * turn);
+    move_camera(&camera, map, camera.dir_x, camera.dir_y,
+                MOVE_SPEED_SEC * dt * 0.5f);
+    path[i] = camera;
+  }
+
+  return path;
 }
 
 typedef struct {
-  float pos_x, pos_y;
-  float dir_x, dir_y;
-  float plane_x, plane_y;
-} Camera;
-
-static void rotate_camera(Camera *camera, float rad) {
-  float cos_rad = cosf(rad);
-  float sin_rad = sinf(rad);
-
-  float new_dir_x = camera->dir_x * cos_rad - camera->dir_y * sin_rad;
-  float new_dir_y = camera->dir_x * sin_rad + camera->dir_y * cos_rad;
-  float new_plane_x = camera->plane_x * cos_rad - camera->plane_y * sin_rad;
-  float new_plane_y = camera->plane_x * sin_rad + camera->plane_y * cos_rad;
+  int render_threads;
+  int width; // initial window size, or the output size when benchmarking
+  int height;
+  int render_scale; // percent
+  int split;        // views the frame is split into
+  int pip;          // with an inset rear view
+  float budget_ms;  // dynamic resolution target, 0 when disabled
+  int bench_frames;
+  const char *bench_path;
+  const char *record_path;
+  const char *trace_path;
+  const char *pack_path; // load this baked pack instead of the text files
+  const char *bake_path;
+  const char *render_path; // camera poses to render headless
+  const char *render_out;  // raw frames file, "-" for stdout
+  const char *baseline_path; // bench frame times to compare against
+  int synthetic; // generated map size instead of map.txt, 0 for none
+  int check;     // compare the kernel variants' frames to the reference
+} Options;
 
-  camera->dir_x = new_dir_x;
-  camera->dir_y = new_dir_y;
-  camera->plane_x = new_plane_x;
-  camera->plane_y = new_plane_y;
+static int compare_u64(const void *a, const void *b) {
+  Uint64 x = *(const Uint64 *)a, y = *(const Uint64 *)b;
+  return (x > y) - (x < y);
 }
 
-#define MAX_STEP (CAMERA_RADIUS * 0.5f)
-
-static void move_camera(Camera *cam, const struct Map *map, float dir_x,
-                        float dir_y, float speed) {
-  float remaining = fabsf(speed);
-  if (speed < 0.0f) {
-    dir_x = -dir_x;
-    dir_y = -dir_y;
-  }
+typedef struct {
+  double min_ms, avg_ms, p50_ms, p99_ms, max_ms;
+} PassStats;
 
-  // normalize direction vector
-  float len = hypotf(dir_x, dir_y);
-  if (len == 0.0f)
-    return;
-  dir_x /= len;
-  dir_y /= len;
+static PassStats pass_stats(Uint64 *ticks, int n, double ms_per_tick) {
+  Uint64 sum = 0;
+  for (int i = 0; i < n; i++)
+    sum += ticks[i];
+  qsort(ticks, n, sizeof(*ticks), compare_u64);
 
-  // micro-step to avoid tunneling through walls
-  int max_iter = 64;
-  while (remaining > 1e-6f && max_iter--) {
-    float step = (remaining > MAX_STEP) ? MAX_STEP : remaining;
-    remaining -= step;
+  return (PassStats){ticks[0] * ms_per_tick, (double)sum / n * ms_per_tick,
+                     ticks[(n - 1) / 2] * ms_per_tick,
+                     ticks[(n - 1) * 99 / 100] * ms_per_tick,
+                     ticks[n - 1] * ms_per_tick};
+}
 
-    float nx = cam->pos_x + dir_x * step;
-    if (!is_solid(map, (int)floorf(nx + sgnf(dir_x) * CAMERA_RADIUS),
-                  (int)floorf(cam->pos_y)))
-      cam->pos_x = nx;
+// What a benchmark measured, printed as JSON and read back as a baseline.
+typedef struct {
+  char map[256];
+  int frames;
+  int width;
+  int height;
+  int views;
+  int threads;
+  char floor_kernel[16];
+  char ray_kernel[16];
+  int skipped;
+  PassStats passes[SCOPE_COUNT];
+} BenchResult;
 
-    float ny = cam->pos_y + dir_y * step;
-    if (!is_solid(map, (int)floorf(cam->pos_x),
-                  (int)floorf(ny + sgnf(dir_y) * CAMERA_RADIUS)))
-      cam->pos_y = ny;
+static void print_bench(FILE *f, const BenchResult *r) {
+  fprintf(f, "{\n");
+  fprintf(f, "  \"map\": \"%s\",\n", r->map);
+  fprintf(f, "  \"frames\": %d,\n", r->frames);
+  fprintf(f, "  \"width\": %d,\n", r->width);
+  fprintf(f, "  \"height\": %d,\n", r->height);
+  fprintf(f, "  \"views\": %d,\n", r->views);
+  fprintf(f, "  \"threads\": %d,\n", r->threads);
+  fprintf(f, "  \"floor_kernel\": \"%s\",\n", r->floor_kernel);
+  fprintf(f, "  \"ray_kernel\": \"%s\",\n", r->ray_kernel);
+  fprintf(f, "  \"frames_skipped\": %d,\n", r->skipped);
+  fprintf(f, "  \"passes\": {\n");
+  for (int p = 0; p < SCOPE_COUNT; p++) {
+    if (p == SCOPE_HUD)
+      continue;
+    const PassStats *s = &r->passes[p];
+    fprintf(f,
+            "    \"%s\": {\"min_ms\": %.4f, \"avg_ms\": %.4f, "
+            "\"p50_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f}%s\n",
+            scope_names[p], s->min_ms, s->avg_ms, s->p50_ms, s->p99_ms,
+            s->max_ms, p == SCOPE_PRESENT ? "" : ",");
   }
-
-#if DEBUG
-  if (is_solid(map, (int)cam->pos_x, (int)cam->pos_y))
-    fprintf(stderr, "inside wall @ (%.2f, %.2f)\n", cam->pos_x, cam->pos_y);
-#endif
+  fprintf(f, "  }\n}\n");
 }
 
-static inline unsigned int dim_color(unsigned int color, unsigned int factor) {
-  unsigned int br = ((color & 0xFF00FFu) * factor) >> 8;
-  unsigned int g = ((color & 0x00FF00u) * factor) >> 8;
-  return 0xFF000000 | (br & 0xFF00FFu) | (g & 0x00FF00u);
+// The value after "key": in JSON written by print_bench(), NULL if the key
+// isn't there.
+static const char *bench_field(const char *json, const char *key) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\": ", key);
+  const char *at = strstr(json, pattern);
+  return at ? at + strlen(pattern) : NULL;
 }
 
-static void clear_pixels(uint8_t *pixels) {
-  memset(pixels, 0, SCREEN_HEIGHT * STRIDE);
+static int bench_int(const char *json, const char *key, int *value) {
+  const char *at = bench_field(json, key);
+  return at && sscanf(at, "%d", value) == 1;
 }
 
-static float *generate_camera_lut() {
-  float *lut = (float *)malloc(SCREEN_WIDTH * sizeof(float));
-  if (!lut)
-    return NULL;
+// Reads a baseline written by print_bench(), 0 if it isn't one.
+static int read_bench(const char *path, BenchResult *r) {
+  char json[8192];
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  size_t n = fread(json, 1, sizeof(json) - 1, f);
+  fclose(f);
+  json[n] = '\0';
 
-  for (int i = 0; i < SCREEN_WIDTH; i++)
-    lut[i] = (2.0f * i / SCREEN_WIDTH) - 1.0f;
+  *r = (BenchResult){0};
+  const char *map = bench_field(json, "map");
+  const char *floor = bench_field(json, "floor_kernel");
+  const char *rays = bench_field(json, "ray_kernel");
+  if (!map || sscanf(map, "\"%255[^\"]\"", r->map) != 1 || !floor ||
+      sscanf(floor, "\"%15[^\"]\"", r->floor_kernel) != 1 || !rays ||
+      sscanf(rays, "\"%15[^\"]\"", r->ray_kernel) != 1 ||
+      !bench_int(json, "frames", &r->frames) ||
+      !bench_int(json, "width", &r->width) ||
+      !bench_int(json, "height", &r->height) ||
+      !bench_int(json, "views", &r->views) ||
+      !bench_int(json, "threads", &r->threads))
+    return 0;
 
-  return lut;
+  for (int p = 0; p < SCOPE_COUNT; p++) {
+    if (p == SCOPE_HUD)
+      continue;
+    PassStats *s = &r->passes[p];
+    const char *at = bench_field(json, scope_names[p]);
+    if (!at || sscanf(at,
+                      "{\"min_ms\": %lf, \"avg_ms\": %lf, \"p50_ms\": %lf, "
+                      "\"p99_ms\": %lf, \"max_ms\": %lf}",
+                      &s->min_ms, &s->avg_ms, &s->p50_ms, &s->p99_ms,
+                      &s->max_ms) != 5)
+      return 0;
+  }
+  return 1;
 }
 
-static void vertical_line(uint8_t *pixels, int x, int y0, int y1,
-                          unsigned int color) {
-  unsigned int a = (color >> 24) & 0xFF;
-  unsigned int r = (color >> 16) & 0xFF;
-  unsigned int g = (color >> 8) & 0xFF;
-  unsigned int b = color & 0xFF;
+// Compares the median time of every pass against the baseline. One more
+// than BENCH_TOLERANCE and BENCH_NOISE_MS slower fails, and so does a
+// baseline measured in another setup since its times say nothing.
+static int compare_bench(const BenchResult *r, const BenchResult *base,
+                         const char *path) {
+  if (strcmp(r->map, base->map) != 0 || r->frames != base->frames ||
+      r->width != base->width || r->height != base->height ||
+      r->views != base->views || r->threads != base->threads ||
+      strcmp(r->floor_kernel, base->floor_kernel) != 0 ||
+      strcmp(r->ray_kernel, base->ray_kernel) != 0) {
+    fprintf(stderr,
+            "Baseline %s was measured on another map, size, view, thread "
+            "or kernel setup; delete it to record a new one\n",
+            path);
+    return 0;
+  }
 
-  y0 = maxi(0, y0);
-  y1 = mini(SCREEN_HEIGHT - 1, y1);
+  int ok = 1;
+  for (int p = 0; p < SCOPE_COUNT; p++) {
+    if (p == SCOPE_HUD)
+      continue;
+    double ms = r->passes[p].p50_ms, base_ms = base->passes[p].p50_ms;
+    int slower =
+        ms > base_ms * (1.0 + BENCH_TOLERANCE) && ms - base_ms > BENCH_NOISE_MS;
+    fprintf(stderr, "%-8s p50 %8.3f ms, baseline %8.3f ms, %+7.1f%%%s\n",
+            scope_names[p], ms, base_ms,
+            base_ms > 0.0 ? (ms / base_ms - 1.0) * 100.0 : 0.0,
+            slower ? "  REGRESSION" : "");
+    ok &= !slower;
+  }
+  if (!ok)
+    fprintf(stderr, "Frame times regressed against %s\n", path);
+  return ok;
+}
 
-  unsigned int offset = (y0 * SCREEN_WIDTH + x) * 4;
+// Compares the result against opts->baseline_path, or records it there if
+// there is no such file yet.
+static int check_baseline(const Options *opts, const BenchResult *r) {
+  const char *path = opts->baseline_path;
+  if (access(path, F_OK) == 0) {
+    BenchResult base;
+    if (!read_bench(path, &base)) {
+      fprintf(stderr, "Invalid baseline: %s\n", path);
+      return 0;
+    }
+    return compare_bench(r, &base, path);
+  }
 
-  uint8_t *row = pixels + (size_t)y0 * STRIDE + x * 4;
-  for (int y = y0; y <= y1; y++) {
-    row[0] = b;
-    row[1] = g;
-    row[2] = r;
-    row[3] = a;
-    row += STRIDE;
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "Failed to write baseline: %s\n", path);
+    return 0;
   }
+  print_bench(f, r);
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Failed to write baseline: %s\n", path);
+    return 0;
+  }
+  fprintf(stderr, "Recorded baseline %s\n", path);
+  return 1;
 }
 
-static void render_fps(SDL_Renderer *renderer, TTF_Font *font, float fps) {
-  char fps_text[64];
-  snprintf(fps_text, sizeof(fps_text), "FPS: %.1f", fps);
+static void map_name(const Options *opts, char *name, size_t size) {
+  if (opts->pack_path)
+    snprintf(name, size, "%s", opts->pack_path);
+  else if (opts->synthetic)
+    snprintf(name, size, "synthetic %dx%d", opts->synthetic, opts->synthetic);
+  else
+    snprintf(name, size, "%s", MAP_PATH);
+}
 
-  SDL_Color color = {255, 255, 255, 255};
-  SDL_Surface *surf = TTF_RenderText_Solid(font, fps_text, color);
-  if (!surf) {
-    fprintf(stderr, "TTF_RenderText_Solid Error: %s\n", TTF_GetError());
-    return;
-  }
+// Headless benchmark: renders the camera path without a window, uploading
+// each frame through SDL's software renderer so present is measured too,
+// and prints per-pass frame time statistics as JSON on stdout. With a
+// baseline, fails if they regressed against it.
+static int run_bench(const Options *opts) {
+  int status = EXIT_FAILURE;
+  int frame_count = opts->bench_frames;
+  SDL_Surface *target = NULL;
+  SDL_Renderer *renderer = NULL;
+  RenderTarget rt = {0};
+  Camera *path = NULL;
+  Uint64 *ticks[SCOPE_COUNT] = {NULL};
+  struct Map map = {0};
+  WorkerPool pool;
+  int skipped = 0;
 
-  SDL_Texture *tex = SDL_CreateTextureFromSurface(renderer, surf);
-  if (!tex) {
-    fprintf(stderr, "SDL_CreateTextureFromSurface Error: %s\n", SDL_GetError());
-    SDL_FreeSurface(surf);
-    return;
-  }
+  pool_init(&pool, opts->render_threads);
+  const char *kernel = select_floor_kernel();
+  const char *rays = select_ray_kernel();
+  init_lighting();
 
-  int w, h;
-  SDL_QueryTexture(tex, NULL, NULL, &w, &h);
+  if (!load_world(opts->pack_path, opts->synthetic, &map) ||
+      !tile_loader_wait())
+    goto cleanup;
 
-  SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 128);
-  SDL_Rect bg = {8, 8, w + 4, h + 4};
-  SDL_RenderFillRect(renderer, &bg);
+  Camera start = initial_camera();
+  map_stream_update(&map, &start, 1);
+  path = opts->bench_path ? load_camera_path(opts->bench_path, &frame_count)
+                          : generate_camera_path(&map, frame_count);
+  if (!path)
+    goto cleanup;
+  map_stream_update(&map, &path[0], 1);
 
-  SDL_Rect dst_rect = {10, 10, surf->w, surf->h};
-  SDL_RenderCopy(renderer, tex, NULL, &dst_rect);
+  int allocated = 1;
+  for (int p = 0; p < SCOPE_COUNT; p++)
+    allocated &= (ticks[p] = malloc(frame_count * sizeof(Uint64))) != NULL;
+  target = SDL_CreateRGBSurfaceWithFormat(0, opts->width, opts->height, 32,
+                                          SDL_PIXELFORMAT_ARGB8888);
+  if (!allocated || !target) {
+    fprintf(stderr, "Memory allocation failed for benchmark\n");
+    goto cleanup;
+  }
 
-  SDL_DestroyTexture(tex);
-  SDL_FreeSurface(surf);
-}
+  renderer = SDL_CreateSoftwareRenderer(target);
+  if (!renderer) {
+    fprintf(stderr, "SDL_CreateSoftwareRenderer Error: %s\n", SDL_GetError());
+    goto cleanup;
+  }
+  if (!render_target_resize(&rt, renderer, opts->width, opts->height,
+                            opts->render_scale, opts->split, opts->pip))
+    goto cleanup;
 
-static void render_raycast(float *camera_lut, uint8_t *pixels, Camera *camera,
-                           const struct Map *map) {
+  for (int i = 0; i < frame_count; i++) {
+    profile_frame_begin();
 
-  // FLOOR & CEILING RENDERING
-  for (int y = SCREEN_HEIGHT / 2; y < SCREEN_HEIGHT; y++) {
-    float p = (float)(y - SCREEN_HEIGHT / 2.0f);
-    float camera_z = 0.5f * SCREEN_HEIGHT;
-    float row_dist = camera_z / p;
+    map_stream_update(&map, &path[i], 0);
+    if (!render_frame(&pool, &rt, 100, &path[i], &map))
+      goto cleanup;
+    skipped += rt.skipped;
 
-    float ray_dir_x0 = camera->dir_x - camera->plane_x;
-    float ray_dir_y0 = camera->dir_y - camera->plane_y;
-    float ray_dir_x1 = camera->dir_x + camera->plane_x;
-    float ray_dir_y1 = camera->dir_y + camera->plane_y;
+    profile_begin(SCOPE_PRESENT);
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, rt.texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+    profile_end(SCOPE_PRESENT);
 
-    float step_x = row_dist * (ray_dir_x1 - ray_dir_x0) / SCREEN_WIDTH;
-    float step_y = row_dist * (ray_dir_y1 - ray_dir_y0) / SCREEN_WIDTH;
+    profile_frame_end();
 
-    float floor_x = camera->pos_x + ray_dir_x0 * row_dist;
-    float floor_y = camera->pos_y + ray_dir_y0 * row_dist;
+    for (int p = 0; p < SCOPE_COUNT; p++)
+      ticks[p][i] = profile_current()->ticks[p];
+  }
 
-    for (int x = 0; x < SCREEN_WIDTH; x++) {
-      int map_x = (int)floorf(floor_x);
-      int map_y = (int)floorf(floor_y);
+  double ms_per_tick = 1000.0 / (double)SDL_GetPerformanceFrequency();
+  BenchResult result = {.frames = frame_count,
+                        .width = rt.width,
+                        .height = rt.height,
+                        .views = rt.view_count,
+                        .threads = pool.thread_count + 1,
+                        .skipped = skipped};
+  map_name(opts, result.map, sizeof(result.map));
+  snprintf(result.floor_kernel, sizeof(result.floor_kernel), "%s", kernel);
+  snprintf(result.ray_kernel, sizeof(result.ray_kernel), "%s", rays);
+  for (int p = 0; p < SCOPE_COUNT; p++)
+    result.passes[p] = pass_stats(ticks[p], frame_count, ms_per_tick);
+  print_bench(stdout, &result);
 
-      floor_x += step_x;
-      floor_y += step_y;
+  if (!opts->baseline_path || check_baseline(opts, &result))
+    status = EXIT_SUCCESS;
 
-      Tile *floor_tile = get_tile(map, map_x, map_y);
-      if (!floor_tile || floor_tile->type != TILE_TYPE_FLOOR) {
-        continue;
-      }
+cleanup:
+  render_target_destroy(&rt);
+  SDL_DestroyRenderer(renderer);
+  SDL_FreeSurface(target);
+  for (int p = 0; p < SCOPE_COUNT; p++)
+    free(ticks[p]);
+  free(path);
+  free_map(&map);
+  free_tile_registry();
+  pool_destroy(&pool);
+  return status;
+}
 
-      int tex_x = ((int)((floor_x - map_x) * floor_tile->width) &
-                   (floor_tile->width - 1));
-      int tex_y = ((int)((floor_y - map_y) * floor_tile->height) &
-                   (floor_tile->height - 1));
-
-      uint32_t floor_color =
-          floor_tile->pixels[tex_y * floor_tile->width + tex_x];
-      uint8_t *fp = pixels + (size_t)y * STRIDE + x * 4;
-      fp[0] = floor_color & 0xFF;         // B
-      fp[1] = (floor_color >> 8) & 0xFF;  // G
-      fp[2] = (floor_color >> 16) & 0xFF; // R
-      fp[3] = 0xFF;                       // A
-
-      Tile *ceil_tile = get_tile_by_id(CEILING_TILE_ID);
-      uint32_t ceil_color = ceil_tile->pixels[tex_y * ceil_tile->width + tex_x];
-      ceil_color = (ceil_color >> 1) & 8355711; // make a bit darker
-      uint8_t *cp = pixels + (size_t)(SCREEN_HEIGHT - y - 1) * STRIDE + x * 4;
-      cp[0] = ceil_color & 0xFF;         // B
-      cp[1] = (ceil_color >> 8) & 0xFF;  // G
-      cp[2] = (ceil_color >> 16) & 0xFF; // R
-      cp[3] = 0xFF;                      // A
-    }
-  }
-
-  // WALL RENDERING
-  for (int x = 0; x < SCREEN_WIDTH; x++) {
-    float camera_x = camera_lut[x];
-
-    float ray_dir_x = camera->dir_x + camera->plane_x * camera_x;
-    float ray_dir_y = camera->dir_y + camera->plane_y * camera_x;
-
-    float ray_pos_x = camera->pos_x;
-    float ray_pos_y = camera->pos_y;
-
-    int map_x = (int)ray_pos_x;
-    int map_y = (int)ray_pos_y;
-
-    // length of ray from one x or y-side to next x or y-side
-    float delta_dist_x = inv_abs(ray_dir_x);
-    float delta_dist_y = inv_abs(ray_dir_y);
-
-    int step_x = sgnf(ray_dir_x);
-    int step_y = sgnf(ray_dir_y);
-
-    // length of ray from current position to next x or y-side
-    float side_dist_x = (ray_dir_x < 0)
-                            ? (ray_pos_x - map_x) * delta_dist_x
-                            : (map_x + 1.0f - ray_pos_x) * delta_dist_x;
-    float side_dist_y = (ray_dir_y < 0)
-                            ? (ray_pos_y - map_y) * delta_dist_y
-                            : (map_y + 1.0f - ray_pos_y) * delta_dist_y;
-
-    Tile *hit_tile = NULL;
-    int hit_side = 0;
-    for (int steps = 0; steps < MAP_MAX_STEPS; steps++) {
-      if (side_dist_x < side_dist_y) {
-        side_dist_x += delta_dist_x;
-        map_x += step_x;
-        hit_side = 0;
-      } else {
-        side_dist_y += delta_dist_y;
-        map_y += step_y;
-        hit_side = 1;
-      }
+// Places around the map to check from, CHECK_TURNS frames turning in place
+// at each one, so reprojected rays get checked too. The same for every run.
+static Camera *generate_check_poses(const struct Map *map, int *count) {
+  Camera *poses = malloc(CHECK_POSES * CHECK_TURNS * sizeof(Camera));
+  if (!poses)
+    return NULL;
 
-      hit_tile = get_tile(map, map_x, map_y);
-      if (hit_tile && hit_tile->type == TILE_TYPE_WALL) {
+  uint32_t seed = SYNTHETIC_SEED;
+  int n = 0;
+  for (int p = 0; p < CHECK_POSES; p++) {
+    Camera camera = initial_camera();
+    for (int tries = 0; tries < 64; tries++) {
+      seed = seed * 1664525u + 1013904223u;
+      int x = (int)((seed >> 8) % map->width);
+      seed = seed * 1664525u + 1013904223u;
+      int y = (int)((seed >> 8) % map->height);
+      if (!is_solid(map, x, y)) {
+        camera.pos_x = x + 0.5f;
+        camera.pos_y = y + 0.5f;
         break;
       }
+    }
+    seed = seed * 1664525u + 1013904223u;
+    rotate_camera(&camera, (float)((seed >> 8) * (2.0 * M_PI / 16777216.0)));
 
-      // continue searching
-      hit_tile = NULL;
+    for (int t = 0; t < CHECK_TURNS; t++) {
+      poses[n++] = camera;
+      rotate_camera(&camera, 0.02f);
     }
+  }
+
+  *count = n;
+  return poses;
+}
+
+static int write_ppm(const char *path, const uint32_t *pixels, int width,
+                     int height) {
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "Failed to write %s\n", path);
+    return 0;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int i = 0; i < width * height; i++) {
+    uint32_t p = pixels[i];
+    fputc((p >> 16) & 0xFF, f);
+    fputc((p >> 8) & 0xFF, f);
+    fputc(p & 0xFF, f);
+  }
+  return fclose(f) == 0;
+}
+
+// A way of rendering the frame that must match the reference: other floor
+// or ray kernels, more threads or the ray cache. tolerance is the share of
+// pixels that may differ in a frame.
+typedef struct {
+  char name[32];
+  FloorKernel floor[FLOOR_KERNEL_COUNT];
+  RayKernel rays;
+  WorkerPool *pool;
+  RayCache *cache;
+  float tolerance;
+  long pixels;  // differing from the reference over all frames
+  int failed;   // frames with more than the tolerance
+  int captured; // their first one went to CHECK_CAPTURES
+} CheckVariant;
+
+// Adds a variant drawing with the kernels, only the generic one of them
+// with generic set. Only the ray cache is allowed to differ, as it reuses
+// hits cast from a slightly different direction.
+static void add_variant(CheckVariant *variants, int *count, const char *name,
+                        const FloorKernel *kernels, int generic,
+                        RayKernel rays, WorkerPool *pool, RayCache *cache) {
+  CheckVariant *v = &variants[(*count)++];
+  *v = (CheckVariant){.rays = rays,
+                      .pool = pool,
+                      .cache = cache,
+                      .tolerance = cache ? CHECK_CACHE_TOLERANCE : 0.0f};
+  snprintf(v->name, sizeof(v->name), "%s", name);
+  for (int k = 0; k < FLOOR_KERNEL_COUNT; k++)
+    v->floor[k] = kernels[generic ? FLOOR_KERNEL_ANY : k];
+}
+
+static void check_frame(CheckVariant *v, int frame, const uint32_t *expected,
+                        const uint32_t *pixels, int width, int height) {
+  int diff = 0;
+  for (int i = 0; i < width * height; i++)
+    diff += pixels[i] != expected[i];
+  v->pixels += diff;
+  if (diff <= v->tolerance * width * height)
+    return;
+
+  v->failed++;
+  if (v->captured)
+    return;
+  v->captured = 1;
+  char path[256];
+  mkdir(CHECK_CAPTURES, 0755);
+  snprintf(path, sizeof(path), CHECK_CAPTURES "/%.31s-%d-expected.ppm",
+           v->name, frame);
+  write_ppm(path, expected, width, height);
+  snprintf(path, sizeof(path), CHECK_CAPTURES "/%.31s-%d.ppm", v->name, frame);
+  write_ppm(path, pixels, width, height);
+}
+
+// Headless golden-image check: renders fixed poses with the generic scalar
+// floor and ray kernels on one thread, the reference, and again with each
+// kernel this CPU runs, on CHECK_THREADS threads and through the ray cache.
+// Every variant changes one of these only, so a failure points at it. They
+// are all meant to draw the same pixels; the first frame that doesn't is
+// written to CHECK_CAPTURES next to the reference.
+static int run_check(const Options *opts) {
+  int status = EXIT_FAILURE;
+  int w = opts->width, h = opts->height;
+  int frame_count = 0;
+  struct Map map = {0};
+  Camera *poses = NULL;
+  uint32_t *expected = malloc((size_t)w * h * sizeof(uint32_t));
+  uint32_t *pixels = malloc((size_t)w * h * sizeof(uint32_t));
+  float *camera_lut = generate_camera_lut(w);
+  float *row_lut = generate_row_lut(h);
+  float *depth = malloc(w * sizeof(float));
+  RayCache cache = {.hits = {malloc(w * sizeof(RayHit)),
+                             malloc(w * sizeof(RayHit))},
+                    .capacity = w};
+  CheckVariant variants[2 * FLOOR_ISA_COUNT + 3];
+  int variant_count = 0;
+  WorkerPool serial, threads;
+
+  pool_init(&serial, 1);
+  pool_init(&threads, CHECK_THREADS);
+  init_lighting();
+  const char *best_floor = select_floor_kernel();
+  const FloorKernel *best_kernels = floor_kernels;
+  select_ray_kernel();
+  RayKernel best_rays = ray_kernel;
+
+  if (!expected || !pixels || !camera_lut || !row_lut || !depth ||
+      !cache.hits[0] || !cache.hits[1]) {
+    fprintf(stderr, "Memory allocation failed for check\n");
+    goto cleanup;
+  }
+  if (!load_world(opts->pack_path, opts->synthetic, &map) ||
+      !tile_loader_wait())
+    goto cleanup;
+  Camera start = initial_camera();
+  map_stream_update(&map, &start, 1);
+  poses = generate_check_poses(&map, &frame_count);
+  if (!poses)
+    goto cleanup;
 
-    if (!hit_tile) {
-      vertical_line(pixels, x, 0, SCREEN_HEIGHT - 1, SKY_COLOR);
+  for (int i = 0; i < FLOOR_ISA_COUNT; i++) {
+    if (!floor_isa_supported(i))
       continue;
-    }
+    char name[32];
+    snprintf(name, sizeof(name), "floor-%s", floor_isas[i].name);
+    add_variant(variants, &variant_count, name, floor_isas[i].kernels, 0,
+                cast_rays_scalar, &serial, NULL);
+    snprintf(name, sizeof(name), "floor-%s-generic", floor_isas[i].name);
+    add_variant(variants, &variant_count, name, floor_isas[i].kernels, 1,
+                cast_rays_scalar, &serial, NULL);
+  }
+  if (best_rays != cast_rays_scalar)
+    add_variant(variants, &variant_count, "rays-avx2",
+                floor_span_scalar_kernels, 1, best_rays, &serial, NULL);
+  char name[32];
+  snprintf(name, sizeof(name), "threads-%d", threads.thread_count + 1);
+  add_variant(variants, &variant_count, name, floor_span_scalar_kernels, 1,
+              cast_rays_scalar, &threads, NULL);
+  add_variant(variants, &variant_count, "ray-cache",
+              floor_span_scalar_kernels, 1, cast_rays_scalar, &serial,
+              &cache);
+
+  FloorKernel reference[FLOOR_KERNEL_COUNT];
+  for (int k = 0; k < FLOOR_KERNEL_COUNT; k++)
+    reference[k] = floor_span_scalar_kernels[FLOOR_KERNEL_ANY];
+
+  for (int f = 0; f < frame_count; f++) {
+    map_stream_update(&map, &poses[f], 1);
+    View view = {.width = w,
+                 .height = h,
+                 .camera = &poses[f],
+                 .camera_lut = camera_lut,
+                 .row_lut = row_lut,
+                 .depth = depth,
+                 .wall_columns = w};
+    Framebuffer fb = {.pixels = (uint8_t *)expected,
+                      .pitch = w * 4,
+                      .width = w,
+                      .height = h};
 
-    // calculate the perpendicular distance to the wall
-    float perp_wall_dist = (hit_side == 0) ? side_dist_x - delta_dist_x
-                                           : side_dist_y - delta_dist_y;
-    if (perp_wall_dist < 1e-6f)
-      perp_wall_dist = 1e-6f;
+    floor_kernels = reference;
+    ray_kernel = cast_rays_scalar;
+    render_views(&serial, &view, 1, &fb, &map);
 
-    float wall_x = (hit_side == 0) ? (ray_pos_y + perp_wall_dist * ray_dir_y)
-                                   : (ray_pos_x + perp_wall_dist * ray_dir_x);
-    wall_x -= floorf(wall_x);
+    fb.pixels = (uint8_t *)pixels;
+    for (int i = 0; i < variant_count; i++) {
+      CheckVariant *v = &variants[i];
+      floor_kernels = v->floor;
+      ray_kernel = v->rays;
+      view.rays = v->cache;
+      render_views(v->pool, &view, 1, &fb, &map);
+      check_frame(v, f, expected, pixels, w, h);
+    }
+  }
 
-    int tex_x = (int)(wall_x * hit_tile->width) & (hit_tile->width - 1);
-    if ((hit_side == 0 && ray_dir_x > 0) || (hit_side == 1 && ray_dir_y < 0)) {
-      tex_x = hit_tile->width - 1 - tex_x;
+  status = EXIT_SUCCESS;
+  printf("%d frames at %dx%d of %s, best floor kernel %s\n", frame_count, w,
+         h, map.stream ? "a streamed map" : "the map", best_floor);
+  for (int i = 0; i < variant_count; i++) {
+    CheckVariant *v = &variants[i];
+    if (v->failed) {
+      printf("%-20s FAILED in %d frames, see " CHECK_CAPTURES "/\n", v->name,
+             v->failed);
+      status = EXIT_FAILURE;
+    } else if (v->pixels) {
+      printf("%-20s %ld pixels differ, within tolerance\n", v->name,
+             v->pixels);
+    } else {
+      printf("%-20s identical\n", v->name);
     }
+  }
+
+cleanup:
+  floor_kernels = best_kernels;
+  ray_kernel = best_rays;
+  free(poses);
+  free(expected);
+  free(pixels);
+  free(camera_lut);
+  free(row_lut);
+  free(depth);
+  free(cache.hits[0]);
+  free(cache.hits[1]);
+  free_map(&map);
+  free_tile_registry();
+  pool_destroy(&threads);
+  pool_destroy(&serial);
+  return status;
+}
 
-    int line_height = (int)(SCREEN_HEIGHT / perp_wall_dist);
-    int draw_start = maxi(0, (SCREEN_HEIGHT - line_height) / 2);
-    int draw_end = mini(SCREEN_HEIGHT - 1, (SCREEN_HEIGHT + line_height) / 2);
+// Headless batch render of a camera path through the raycaster.h API. The
+// frames go to opts->render_out as raw ARGB8888 pixels, one after another,
+// written straight into a shared mapping of the file, or in batches of
+// RENDER_BATCH_FRAMES down stdout for "-".
+static int run_render(const Options *opts) {
+  int status = EXIT_FAILURE;
+  int count = 0;
+  int w = opts->width, h = opts->height;
+  size_t frame_size = (size_t)w * h * sizeof(uint32_t);
+  uint32_t *frames = NULL;
+  size_t mapped = 0;
+  int fd = -1;
+  Raycaster *rc = NULL;
 
-    for (int y = draw_start; y <= draw_end; y++) {
-      int d = y * 256 - SCREEN_HEIGHT * 128 + line_height * 128;
-      int tex_y = ((d * hit_tile->height) / line_height) / 256;
+  Camera *poses = load_camera_path(opts->render_path, &count);
+  if (!poses)
+    goto cleanup;
+  rc = raycaster_create(opts->pack_path, opts->render_threads);
+  if (!rc)
+    goto cleanup;
 
-      uint32_t color = hit_tile->pixels[tex_y * hit_tile->width + tex_x];
-      if (hit_side)
-        color = dim_color(color, WALL_DIM_FACTOR);
+  int to_stdout = strcmp(opts->render_out, "-") == 0;
+  if (to_stdout) {
+    frames = malloc(frame_size * RENDER_BATCH_FRAMES);
+    if (!frames) {
+      fprintf(stderr, "Memory allocation failed for frames\n");
+      goto cleanup;
+    }
+  } else {
+    mapped = frame_size * count;
+    fd = open(opts->render_out, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)mapped) != 0) {
+      fprintf(stderr, "Failed to create %s\n", opts->render_out);
+      mapped = 0;
+      goto cleanup;
+    }
+    frames = mmap(NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (frames == MAP_FAILED) {
+      fprintf(stderr, "Failed to map %s\n", opts->render_out);
+      frames = NULL;
+      mapped = 0;
+      goto cleanup;
+    }
+  }
 
-      uint8_t *p = pixels + (size_t)y * STRIDE + x * 4;
-      p[0] = color & 0xFF;         // B
-      p[1] = (color >> 8) & 0xFF;  // G
-      p[2] = (color >> 16) & 0xFF; // R
-      p[3] = 0xFF;                 // A
+  Uint64 start = SDL_GetPerformanceCounter();
+  if (to_stdout) {
+    for (int i = 0; i < count; i += RENDER_BATCH_FRAMES) {
+      int n = mini(count - i, RENDER_BATCH_FRAMES);
+      if (!raycaster_render_batch(rc, poses + i, n, frames, w, h))
+        goto cleanup;
+      if (fwrite(frames, frame_size, n, stdout) != (size_t)n) {
+        fprintf(stderr, "Failed to write frames\n");
+        goto cleanup;
+      }
     }
+    fflush(stdout);
+  } else if (!raycaster_render_batch(rc, poses, count, frames, w, h)) {
+    goto cleanup;
   }
+
+  double seconds = (double)(SDL_GetPerformanceCounter() - start) /
+                   (double)SDL_GetPerformanceFrequency();
+  int threads = rc->pool.thread_count + 1;
+  fprintf(stderr,
+          "Rendered %d frames of %dx%d in %.3f s: %.1f frames/s, %.1f per "
+          "thread (%d threads)\n",
+          count, w, h, seconds, count / seconds, count / seconds / threads,
+          threads);
+  status = EXIT_SUCCESS;
+
+cleanup:
+  if (mapped)
+    munmap(frames, mapped);
+  else
+    free(frames);
+  if (fd >= 0)
+    close(fd);
+  raycaster_destroy(rc);
+  free(poses);
+  return status;
 }
 
 int main(int argc, char *argv[]) {
   int status = EXIT_FAILURE;
   SDL_Window *window = NULL;
   SDL_Renderer *renderer = NULL;
-  SDL_Texture *texture = NULL;
-  uint8_t *pixels = NULL;
-  float *camera_lut = NULL;
+  RenderTarget rt = {0};
   TTF_Font *font = NULL;
+  GlyphAtlas hud = {0};
+  FILE *record = NULL;
+  WorkerPool pool;
+  Options opts = {.render_threads = RENDER_THREADS,
+                  .width = SCREEN_WIDTH,
+                  .height = SCREEN_HEIGHT,
+                  .render_scale = RENDER_SCALE,
+                  .split = SPLIT_VIEWS,
+                  .pip = PIP_VIEW};
+  int output_w, output_h;
+  int show_profiler = 0;
+  unsigned wall_id = MAP_NO_TILE; // built by the edit key
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      opts.render_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc &&
+               sscanf(argv[i + 1], "%dx%d", &opts.width, &opts.height) == 2 &&
+               opts.width > 0 && opts.height > 0) {
+      i++;
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      opts.render_scale = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--views") == 0 && i + 1 < argc) {
+      opts.split = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--pip") == 0) {
+      opts.pip = 1;
+    } else if (strcmp(argv[i], "--budget") == 0) {
+      opts.budget_ms = FRAME_BUDGET_MS;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        opts.budget_ms = (float)atof(argv[++i]);
+    } else if (strcmp(argv[i], "--bench") == 0) {
+      opts.bench_frames = BENCH_FRAMES;
+      if (i + 1 < argc && argv[i + 1][0] != '-')
+        opts.bench_frames = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--bench-path") == 0 && i + 1 < argc) {
+      opts.bench_path = argv[++i];
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      opts.record_path = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      opts.trace_path = argv[++i];
+    } else if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+      opts.pack_path = argv[++i];
+    } else if (strcmp(argv[i], "--bake") == 0 && i + 1 < argc) {
+      opts.bake_path = argv[++i];
+    } else if (strcmp(argv[i], "--render") == 0 && i + 1 < argc) {
+      opts.render_path = argv[++i];
+    } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+      opts.render_out = argv[++i];
+    } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+      opts.baseline_path = argv[++i];
+    } else if (strcmp(argv[i], "--synthetic") == 0 && i + 1 < argc &&
+               (opts.synthetic = atoi(argv[i + 1])) >= CHUNK_SIZE) {
+      i++;
+    } else if (strcmp(argv[i], "--check") == 0) {
+      opts.check = 1;
+    } else {
+      fprintf(stderr,
+              "Usage: %s [--threads N] [--size WxH] [--scale PERCENT] "
+              "[--views 1|2|4] [--pip]\n"
+              "       [--budget [MS]] [--pack FILE] [--synthetic N] "
+              "[--record FILE] [--trace FILE]\n"
+              "       %s --bench [FRAMES] [--bench-path FILE] [--size WxH] "
+              "[--scale PERCENT]\n"
+              "       [--views 1|2|4] [--pip] [--threads N] [--pack FILE] "
+              "[--synthetic N]\n"
+              "       [--trace FILE] [--baseline FILE]\n"
+              "       %s --check [--size WxH] [--pack FILE] [--synthetic N]\n"
+              "       %s --render POSES --out FILE|- [--size WxH] "
+              "[--threads N] [--pack FILE]\n"
+              "       %s --bake FILE [--synthetic N]\n",
+              argv[0], argv[0], argv[0], argv[0], argv[0]);
+      goto cleanup;
+    }
+  }
+  opts.render_scale = clamp_render_scale(opts.render_scale);
+
+  if (opts.bake_path) {
+    struct Map map = {0};
+    if (load_world(NULL, opts.synthetic, &map) && tile_loader_wait() &&
+        bake_pack(opts.bake_path, &map))
+      status = EXIT_SUCCESS;
+    free_map(&map);
+    free_tile_registry();
+    goto cleanup;
+  }
+
+  if (opts.trace_path && !profile_open_trace(opts.trace_path))
+    goto cleanup;
+
+  if (opts.render_path || opts.render_out) {
+    if (!opts.render_path || !opts.render_out) {
+      fprintf(stderr, "--render and --out go together\n");
+      goto cleanup;
+    }
+    if (SDL_Init(0) != 0) {
+      fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
+      goto cleanup;
+    }
+    status = run_render(&opts);
+    goto cleanup_sdl;
+  }
+
+  if (opts.check) {
+    if (SDL_Init(0) != 0) {
+      fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
+      goto cleanup;
+    }
+    status = run_check(&opts);
+    goto cleanup_sdl;
+  }
+
+  if (opts.bench_frames > 0 || opts.bench_path) {
+    if (SDL_Init(0) != 0) {
+      fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
+      goto cleanup;
+    }
+    if (opts.bench_frames <= 0)
+      opts.bench_frames = BENCH_FRAMES;
+    status = run_bench(&opts);
+    goto cleanup_sdl;
+  }
 
   if (SDL_Init(SDL_INIT_VIDEO) != 0) {
     fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
@@ -540,18 +5748,20 @@ int main(int argc, char *argv[]) {
 
 #if FULLSCREEN_MODE
   window = SDL_CreateWindow("Test", SDL_WINDOWPOS_CENTERED,
-                            SDL_WINDOWPOS_CENTERED, SCREEN_WIDTH, SCREEN_HEIGHT,
+                            SDL_WINDOWPOS_CENTERED, opts.width, opts.height,
                             SDL_WINDOW_FULLSCREEN_DESKTOP);
 #else
   window =
       SDL_CreateWindow("Test", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                       SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_RESIZABLE);
+                       opts.width, opts.height, SDL_WINDOW_RESIZABLE);
 #endif
   if (!window) {
     fprintf(stderr, "SDL_CreateWindow Error: %s\n", SDL_GetError());
     goto cleanup_font;
   }
 
+  // Linear filtering for the upscale when rendering below output resolution
+  SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
   renderer = SDL_CreateRenderer(
       window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
   if (!renderer) {
@@ -559,115 +5769,202 @@ int main(int argc, char *argv[]) {
     goto cleanup_window;
   }
 
-  texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
-                              SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH,
-                              SCREEN_HEIGHT);
-  if (!texture) {
-    fprintf(stderr, "SDL_CreateTexture Error: %s\n", SDL_GetError());
-    goto cleanup_renderer;
-  }
+  SDL_GetRendererOutputSize(renderer, &output_w, &output_h);
+  if (!render_target_resize(&rt, renderer, output_w, output_h,
+                            opts.render_scale, opts.split, opts.pip))
+    goto cleanup_render_target;
 
-  pixels = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
-  if (!pixels) {
-    fprintf(stderr, "Memory allocation failed for pixels\n");
-    goto cleanup_texture;
+  if (!hud_init(&hud, renderer, font)) {
+    fprintf(stderr, "Failed to build the HUD glyph atlas\n");
+    goto cleanup_render_target;
   }
 
-  camera_lut = generate_camera_lut();
-  if (!camera_lut) {
-    fprintf(stderr, "Memory allocation failed for camera LUT\n");
-    goto cleanup_pixels;
-  }
+  struct Map map;
+  if (!load_world(opts.pack_path, opts.synthetic, &map))
+    goto cleanup_tiles;
 
-  load_tiles(TILE_MANIFEST);
-  if (!tile_registry || tile_count == 0) {
-    fprintf(stderr, "Failed to load tiles from manifest: %s\n", TILE_MANIFEST);
-    goto cleanup_camera_lut;
-  }
+  pool_init(&pool, opts.render_threads);
 
-  struct Map map = load_map(MAP_FILE);
-  if (!map.tiles) {
-    fprintf(stderr, "Memory allocation failed for map tiles\n");
-    goto cleanup_tiles;
-  }
+  const char *floor_kernel_name = select_floor_kernel();
+  const char *ray_kernel_name = select_ray_kernel();
+  init_lighting();
+#if DEBUG
+  fprintf(stderr, "Floor kernel: %s, ray kernel: %s, render threads: %d\n",
+          floor_kernel_name, ray_kernel_name, pool.thread_count + 1);
+#else
+  (void)floor_kernel_name;
+  (void)ray_kernel_name;
+#endif
 
-  Camera camera = {
-      .pos_x = 2.0f,
-      .pos_y = 2.0f,
-      .dir_x = -1.0f,
-      .dir_y = 0.0f,
-      .plane_x = 0.0f,
-      .plane_y = FOV_FACTOR,
-  };
+  Camera camera = initial_camera();
+  Camera previous = camera; // the camera one simulation step earlier
+  map_stream_update(&map, &camera, 1);
 
-  float len = sqrtf(camera.dir_x * camera.dir_x + camera.dir_y * camera.dir_y);
-  if (len > 0.f) {
-    camera.dir_x /= len;
-    camera.dir_y /= len;
+  FrameThread frames;
+  int pipelined = PIPELINED_RENDER && frame_thread_start(&frames, &pool);
+
+  if (opts.record_path) {
+    record = fopen(opts.record_path, "w");
+    if (!record)
+      fprintf(stderr, "Failed to open %s for recording\n", opts.record_path);
   }
 
   Uint64 freq = SDL_GetPerformanceFrequency();
   Uint64 last = SDL_GetPerformanceCounter();
 
+  ResolutionController dynres = {.budget_ms = opts.budget_ms,
+                                 .render_scale = opts.render_scale,
+                                 .wall_scale = 100};
   int running = 1;
+  int rescale = 0;
+  int textures_ok = 1;
+  float sim_lag = 0.0f; // simulation time not stepped yet
   SDL_Event e;
 
   while (running) {
+    profile_frame_begin();
+
+    // The frame submitted last time has been rendering during the present.
+    // Once it's done nothing reads the map or the render target until the
+    // next one is submitted.
+    if (pipelined)
+      frame_thread_wait(&frames);
+
     while (SDL_PollEvent(&e)) {
       if (e.type == SDL_QUIT) {
         running = 0;
+      } else if (e.type == SDL_WINDOWEVENT &&
+                 e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+        rescale = 1;
+      } else if (e.type == SDL_KEYDOWN && !e.key.repeat) {
+        switch (e.key.keysym.scancode) {
+        case SDL_SCANCODE_F1:
+          show_profiler = !show_profiler;
+          break;
+        case SDL_SCANCODE_E:
+          use_door(&map, &camera);
+          break;
+        case SDL_SCANCODE_Q:
+          edit_cell(&map, &camera, &wall_id);
+          break;
+        case SDL_SCANCODE_MINUS:
+          dynres.render_scale =
+              clamp_render_scale(dynres.render_scale - RENDER_SCALE_STEP);
+          rescale = 1;
+          break;
+        case SDL_SCANCODE_EQUALS:
+          dynres.render_scale =
+              clamp_render_scale(dynres.render_scale + RENDER_SCALE_STEP);
+          rescale = 1;
+          break;
+        default:
+          break;
+        }
       }
     }
 
+    if (rescale) {
+      SDL_GetRendererOutputSize(renderer, &output_w, &output_h);
+      if (!render_target_resize(&rt, renderer, output_w, output_h,
+                                dynres.render_scale, opts.split, opts.pip))
+        break;
+      rescale = 0;
+    }
+
     Uint64 now = SDL_GetPerformanceCounter();
     float dt = (float)(now - last) / (float)freq;
     last = now;
     float fps = 1.0f / dt;
-    float move_speed = MOVE_SPEED_SEC * dt;
-    float rot_speed = ROT_SPEED_SEC * dt;
 
     const Uint8 *kb = SDL_GetKeyboardState(NULL);
     if (kb[SDL_SCANCODE_ESCAPE])
       break;
-    if (kb[SDL_SCANCODE_LEFT])
-      rotate_camera(&camera, rot_speed);
-    if (kb[SDL_SCANCODE_RIGHT])
-      rotate_camera(&camera, -rot_speed);
-    if (kb[SDL_SCANCODE_W])
-      move_camera(&camera, &map, camera.dir_x, camera.dir_y, move_speed);
-    if (kb[SDL_SCANCODE_S])
-      move_camera(&camera, &map, camera.dir_x, camera.dir_y, -move_speed);
-    if (kb[SDL_SCANCODE_A])
-      move_camera(&camera, &map, camera.dir_y, -camera.dir_x, -move_speed);
-    if (kb[SDL_SCANCODE_D])
-      move_camera(&camera, &map, camera.dir_y, -camera.dir_x, move_speed);
-
-    clear_pixels(pixels);
-
-    render_raycast(camera_lut, pixels, &camera, &map);
-
-    SDL_UpdateTexture(texture, NULL, pixels, STRIDE);
+
+    // The camera and doors advance in fixed steps whatever the frame rate,
+    // and frames show the camera interpolated between the last two steps.
+    sim_lag = fminf(sim_lag + dt, SIM_MAX_LAG);
+    while (sim_lag >= SIM_STEP) {
+      previous = camera;
+      simulate_camera(&camera, &map, kb, SIM_STEP);
+      map_update_doors(&map, SIM_STEP);
+      sim_lag -= SIM_STEP;
+    }
+    Camera view = lerp_camera(&previous, &camera, sim_lag / SIM_STEP);
+
+    map_stream_update(&map, &camera, 0);
+    textures_ok = tile_loader_publish();
+    if (!textures_ok)
+      break;
+
+    if (pipelined) {
+      frame_thread_submit(&frames, &rt, dynres.wall_scale, &view, &map);
+      // Right after startup or a resize there's no older frame to show
+      // while this one renders
+      if (!rt.pending)
+        frame_thread_wait(&frames);
+      if (rt.pending) {
+        profile_begin(SCOPE_UPLOAD);
+        SDL_UpdateTexture(rt.texture, NULL, rt.buffers[rt.front],
+                          rt.width * (int)sizeof(uint32_t));
+        profile_end(SCOPE_UPLOAD);
+        rt.pending = 0;
+      }
+    } else {
+      render_frame(&pool, &rt, dynres.wall_scale, &view, &map);
+    }
+
+    if (record)
+      fprintf(record, "%.6f %.6f %.6f %.6f %.6f %.6f\n", view.pos_x,
+              view.pos_y, view.dir_x, view.dir_y, view.plane_x, view.plane_y);
+
     SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderCopy(renderer, rt.texture, NULL, NULL);
 
-    render_fps(renderer, font, fps);
+    profile_begin(SCOPE_HUD);
+    render_fps(renderer, &hud, fps);
+    if (show_profiler)
+      render_profiler(renderer, &hud);
+    profile_end(SCOPE_HUD);
 
+    // Frame time without the present, which blocks on vsync. Pipelined,
+    // that's the longer of the rendering and the main thread's own work.
+    float render_ms =
+        (float)(SDL_GetPerformanceCounter() - now) * 1000.0f / (float)freq;
+    if (pipelined)
+      render_ms = fmaxf(render_ms, frames.last_ticks * 1000.0f / (float)freq);
+    rescale |= dynres_update(&dynres, render_ms);
+
+    profile_begin(SCOPE_PRESENT);
     SDL_RenderPresent(renderer);
+    profile_end(SCOPE_PRESENT);
+
+    profile_frame_end();
+
+    // Nothing changed and nothing will until there is input, so the next
+    // frame would be the same: sleep until then, waking up now and then for
+    // textures and chunks arriving in the background. The wait doesn't
+    // count as frame time. While keys are held or doors move, the skipped
+    // frames keep accumulating time for the next simulation step instead.
+    if (rt.skipped && simulation_idle(&map, kb)) {
+      SDL_WaitEventTimeout(NULL, IDLE_WAIT_MS);
+      last = SDL_GetPerformanceCounter();
+    }
   }
 
-  status = EXIT_SUCCESS;
+  status = textures_ok ? EXIT_SUCCESS : EXIT_FAILURE;
 
-  free(map.tiles);
+  if (record)
+    fclose(record);
+  if (pipelined)
+    frame_thread_stop(&frames);
+  pool_destroy(&pool);
+  free_map(&map);
 cleanup_tiles:
   free_tile_registry();
-cleanup_camera_lut:
-  free(camera_lut);
-cleanup_pixels:
-  free(pixels);
-cleanup_renderer:
+  hud_destroy(&hud);
+cleanup_render_target:
+  render_target_destroy(&rt);
   SDL_DestroyRenderer(renderer);
-cleanup_texture:
-  SDL_DestroyTexture(texture);
 cleanup_window:
   SDL_DestroyWindow(window);
 cleanup_font:
@@ -677,5 +5974,8 @@ cleanup_ttf:
 cleanup_sdl:
   SDL_Quit();
 cleanup:
+  profile_close_trace();
+  sprite_view_free();
   return status;
 }
+#endif
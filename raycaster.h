@@ -0,0 +1,51 @@
+#ifndef RAYCASTER_H
+#define RAYCASTER_H
+
+#include <stdint.h>
+
+// Headless rendering API. `make lib` builds it into libraycaster.a, which
+// links against SDL2 and SDL2_image but never opens a window. There can be
+// one Raycaster at a time, used from one thread; it renders on its own
+// worker threads.
+
+// Where the camera stands and looks. plane is perpendicular to dir, and
+// its length sets the field of view (0.66 for the engine's default).
+typedef struct {
+  float pos_x, pos_y;
+  float dir_x, dir_y;
+  float plane_x, plane_y;
+} RaycasterPose;
+
+typedef struct Raycaster Raycaster;
+
+// Loads tiles.txt and map.txt from the working directory, or the baked
+// pack at pack_path. threads is the number of render threads, 0 for one per
+// CPU core. Returns NULL on failure, after printing why to stderr.
+Raycaster *raycaster_create(const char *pack_path, int threads);
+void raycaster_destroy(Raycaster *rc);
+
+// Map size in cells, and whether a camera can stand in a cell.
+void raycaster_map_size(const Raycaster *rc, int *width, int *height);
+int raycaster_is_open(const Raycaster *rc, int x, int y);
+
+// Moves count agents, circles of the radius (below 1) centered on (x[i],
+// y[i]), by (dx[i], dy[i]) each. Agents stop at walls, closed doors and
+// cells of streamed maps not loaded yet, and slide along them; they don't
+// collide with each other. Large batches are split across the render
+// threads. Returns 0 for a radius out of range.
+int raycaster_move_agents(Raycaster *rc, float *x, float *y, const float *dx,
+                          const float *dy, int count, float radius);
+
+// Renders the pose into width x height ARGB8888 pixels, rows pitch bytes
+// apart, split across the render threads. Returns 0 on failure.
+int raycaster_render(Raycaster *rc, const RaycasterPose *pose,
+                     uint32_t *pixels, int width, int height, int pitch);
+
+// Renders count poses into as many width x height ARGB8888 frames, one
+// after another in frames. Each render thread renders whole frames, which
+// gets the most frames per second out of every core. Returns 0 on failure.
+int raycaster_render_batch(Raycaster *rc, const RaycasterPose *poses,
+                           int count, uint32_t *frames, int width,
+                           int height);
+
+#endif